@@ -6,18 +6,15 @@
 #include "ed25519.h"
 #include "auth-data.h"
 
-int unet_auth_data_validate(const uint8_t *key, const void *buf, size_t len,
-			    uint64_t *timestamp, const char **json_data)
+int unet_auth_data_verify_init(struct edsign_verify_state *vst, const uint8_t *key,
+			       const void *buf, size_t len)
 {
 	const struct unet_auth_hdr *hdr = buf;
 	const struct unet_auth_data *data = net_data_auth_data_hdr(buf);
-	struct edsign_verify_state vst;
 
-	if (len <= sizeof(*hdr) + sizeof(*data))
+	if (len < UNET_AUTH_HDR_LEN)
 		return -1;
 
-	len -= sizeof(*hdr);
-
 	if (hdr->magic != cpu_to_be32(UNET_AUTH_MAGIC) ||
 	    hdr->version != 0 || data->flags != 0 ||
 	    data->timestamp == 0)
@@ -26,9 +23,23 @@ int unet_auth_data_validate(const uint8_t *key, const void *buf, size_t len,
 	if (key && memcmp(data->pubkey, key, EDSIGN_PUBLIC_KEY_SIZE) != 0)
 		return -2;
 
-	edsign_verify_init(&vst, hdr->signature, data->pubkey);
-	edsign_verify_add(&vst, data, len);
-	if (!edsign_verify(&vst, hdr->signature, data->pubkey))
+	edsign_verify_init(vst, hdr->signature, data->pubkey);
+
+	return 0;
+}
+
+int unet_auth_data_verify_done(struct edsign_verify_state *vst, const void *buf,
+			       size_t len, uint64_t *timestamp, const char **json_data)
+{
+	const struct unet_auth_hdr *hdr = buf;
+	const struct unet_auth_data *data = net_data_auth_data_hdr(buf);
+
+	if (len <= UNET_AUTH_HDR_LEN)
+		return -1;
+
+	len -= sizeof(*hdr);
+
+	if (!edsign_verify(vst, hdr->signature, data->pubkey))
 		return -3;
 
 	if (((char *)data)[len - 1] != 0)
@@ -42,3 +53,22 @@ int unet_auth_data_validate(const uint8_t *key, const void *buf, size_t len,
 
 	return 0;
 }
+
+int unet_auth_data_validate(const uint8_t *key, const void *buf, size_t len,
+			    uint64_t *timestamp, const char **json_data)
+{
+	struct edsign_verify_state vst;
+	int ret;
+
+	if (len <= UNET_AUTH_HDR_LEN)
+		return -1;
+
+	ret = unet_auth_data_verify_init(&vst, key, buf, len);
+	if (ret)
+		return ret;
+
+	edsign_verify_add(&vst, net_data_auth_data_hdr(buf),
+			  len - sizeof(struct unet_auth_hdr));
+
+	return unet_auth_data_verify_done(&vst, buf, len, timestamp, json_data);
+}
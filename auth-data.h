@@ -29,9 +29,21 @@ struct unet_auth_data {
 	uint32_t flags;
 } __packed;
 
+#define UNET_AUTH_HDR_LEN \
+	(sizeof(struct unet_auth_hdr) + sizeof(struct unet_auth_data))
+
 int unet_auth_data_validate(const uint8_t *key, const void *buf, size_t len,
 			    uint64_t *timestamp, const char **json_data);
 
+/*
+ * Incremental validation: init needs the first UNET_AUTH_HDR_LEN bytes,
+ * the data after struct unet_auth_hdr is added with edsign_verify_add()
+ */
+int unet_auth_data_verify_init(struct edsign_verify_state *vst, const uint8_t *key,
+			       const void *buf, size_t len);
+int unet_auth_data_verify_done(struct edsign_verify_state *vst, const void *buf,
+			       size_t len, uint64_t *timestamp, const char **json_data);
+
 static inline const struct unet_auth_data *
 net_data_auth_data_hdr(const void *net_data)
 {
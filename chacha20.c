@@ -234,3 +234,31 @@ void chacha20_encrypt_msg(void *msg, size_t len, const void *nonce, const void *
     chacha_ivsetup(&ctx, nonce, NULL);
 	chacha20_encrypt_bytes(&ctx, msg, msg, len);
 }
+
+/* en/decrypt a part of a message, starting at the given byte offset */
+void chacha20_encrypt_msg_at(void *msg, size_t len, const void *nonce,
+			     const void *key, uint64_t offset)
+{
+	struct chacha_ctx ctx;
+	uint8_t counter[8], block[64];
+	size_t skip = offset % sizeof(block);
+	uint8_t *cur = msg;
+	size_t i;
+
+	offset /= sizeof(block);
+	STORE32_LE(counter, offset);
+	STORE32_LE(counter + 4, offset >> 32);
+
+	chacha_keysetup(&ctx, key);
+	chacha_ivsetup(&ctx, nonce, counter);
+
+	if (skip) {
+		memset(block, 0, sizeof(block));
+		chacha20_encrypt_bytes(&ctx, block, block, sizeof(block));
+		for (i = skip; i < sizeof(block) && len; i++, len--)
+			*(cur++) ^= block[i];
+	}
+
+	if (len)
+		chacha20_encrypt_bytes(&ctx, cur, cur, len);
+}
@@ -12,5 +12,7 @@
 #define CHACHA20_KEY_SIZE	32
 
 void chacha20_encrypt_msg(void *msg, size_t len, const void *nonce, const void *key);
+void chacha20_encrypt_msg_at(void *msg, size_t len, const void *nonce,
+			     const void *key, uint64_t offset);
 
 #endif
@@ -133,7 +133,8 @@ pex_recv_update_response(const uint8_t *data, size_t len, enum pex_opcode op)
 	int net_data_len = 0;
 	void *net_data;
 
-	net_data = pex_msg_update_response_recv(data, len, op, &net_data_len, NULL);
+	net_data = pex_msg_update_response_recv(data, len, op, &net_data_len, NULL,
+						NULL, 0);
 	if (net_data_len < 0)
 		goto out;
 
@@ -197,6 +198,7 @@ pex_handle_update_request(struct sockaddr_in6 *addr, const uint8_t *id, void *da
 		__pex_msg_send(-1, NULL, NULL, 0);
 		done = !pex_msg_update_response_continue(&ctx);
 	}
+	pex_msg_update_response_free(&ctx);
 	sync_done = true;
 	uloop_end();
 }
@@ -231,6 +233,13 @@ static void pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 
 		pex_handle_update_request(addr, hdr->id, data, hdr->len);
 		break;
+	case PEX_MSG_UPDATE_COOKIE:
+		if (hdr->len < sizeof(*msg_req_id) || *msg_req_id != req_id)
+			break;
+
+		if (pex_msg_update_request_cookie(data, hdr->len))
+			__pex_msg_send(-1, NULL, NULL, 0);
+		break;
 	case PEX_MSG_UPDATE_RESPONSE:
 	case PEX_MSG_UPDATE_RESPONSE_DATA:
 	case PEX_MSG_UPDATE_RESPONSE_NO_DATA:
@@ -261,7 +270,7 @@ static int load_network_data(const char *file)
 	struct unet_auth_data *data;
 	const char *json;
 
-	net_data_len = UNETD_NET_DATA_SIZE_MAX;
+	net_data_len = UNETD_NET_DATA_SIZE_LIMIT;
 	net_data = unet_read_file(file, &net_data_len);
 	if (!net_data) {
 		INFO("failed to read input file %s\n", file);
@@ -326,7 +335,7 @@ static int cmd_sync(const char *endpoint, int argc, char **argv)
 
 	curve25519_generate_public(peerpubkey, peerkey);
 	req = pex_msg_update_request_init(peerpubkey, peerkey, pubkey, &ep,
-					  net_data_version, true);
+					  net_data_version, UNETD_NET_DATA_SIZE_LIMIT, true);
 	if (!req)
 		return 1;
 
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/utils.h>
+#include "delta.h"
+
+#define DELTA_BLOCK	16
+
+enum {
+	DELTA_OP_COPY = 1,
+	DELTA_OP_DATA = 2,
+};
+
+struct delta_buf {
+	uint8_t *data;
+	size_t len, size;
+};
+
+static uint8_t *
+delta_buf_add(struct delta_buf *b, size_t len)
+{
+	uint8_t *ret;
+
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+
+	ret = b->data + b->len;
+	b->len += len;
+
+	return ret;
+}
+
+static void
+delta_put_be32(uint8_t *p, uint32_t val)
+{
+	val = cpu_to_be32(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+static uint32_t
+delta_get_be32(const uint8_t *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+
+	return be32_to_cpu(val);
+}
+
+static void
+delta_add_op(struct delta_buf *b, uint8_t op, uint32_t val, uint32_t len)
+{
+	uint8_t *p = delta_buf_add(b, 9);
+
+	p[0] = op;
+	delta_put_be32(p + 1, val);
+	delta_put_be32(p + 5, len);
+}
+
+static void
+delta_add_data(struct delta_buf *b, const uint8_t *data, size_t len)
+{
+	uint8_t *p;
+
+	if (!len)
+		return;
+
+	p = delta_buf_add(b, 5 + len);
+	p[0] = DELTA_OP_DATA;
+	delta_put_be32(p + 1, len);
+	memcpy(p + 5, data, len);
+}
+
+static uint32_t
+delta_hash(const uint8_t *data)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < DELTA_BLOCK; i++)
+		h = (h ^ data[i]) * 16777619U;
+
+	return h;
+}
+
+void *delta_encode(const void *base, size_t base_len, const void *data,
+		   size_t len, size_t *delta_len)
+{
+	const uint8_t *old = base, *new = data;
+	struct delta_buf b = {};
+	size_t i, s, e, o, lit = 0;
+	unsigned int size = 16;
+	int32_t *table;
+
+	/* index of the base, one entry per block */
+	while (size < 2 * base_len / DELTA_BLOCK)
+		size *= 2;
+
+	table = malloc(size * sizeof(*table));
+	memset(table, 0xff, size * sizeof(*table));
+	for (i = 0; i + DELTA_BLOCK <= base_len; i += DELTA_BLOCK) {
+		uint32_t h = delta_hash(old + i) & (size - 1);
+
+		if (table[h] < 0)
+			table[h] = i;
+	}
+
+	delta_put_be32(delta_buf_add(&b, 4), len);
+
+	i = 0;
+	while (i + DELTA_BLOCK <= len) {
+		int32_t match = table[delta_hash(new + i) & (size - 1)];
+
+		if (match < 0 || memcmp(old + match, new + i, DELTA_BLOCK) != 0) {
+			i++;
+			continue;
+		}
+
+		/* extend the match in both directions */
+		s = i;
+		o = match;
+		while (s > lit && o > 0 && new[s - 1] == old[o - 1]) {
+			s--;
+			o--;
+		}
+
+		e = i + DELTA_BLOCK;
+		while (e < len && o + (e - s) < base_len && new[e] == old[o + (e - s)])
+			e++;
+
+		delta_add_data(&b, new + lit, s - lit);
+		delta_add_op(&b, DELTA_OP_COPY, o, e - s);
+		i = lit = e;
+	}
+
+	delta_add_data(&b, new + lit, len - lit);
+	free(table);
+
+	*delta_len = b.len;
+
+	return b.data;
+}
+
+void *delta_apply(const void *base, size_t base_len, const void *delta,
+		  size_t delta_len, size_t max_len, size_t *len)
+{
+	const uint8_t *d = delta, *end = d + delta_len;
+	const uint8_t *old = base;
+	uint32_t ofs, cur_len;
+	size_t out_len, pos = 0;
+	uint8_t *out;
+
+	if (delta_len < 4)
+		return NULL;
+
+	out_len = delta_get_be32(d);
+	if (!out_len || out_len > max_len)
+		return NULL;
+
+	out = malloc(out_len);
+	for (d += 4; d < end; ) {
+		switch (d[0]) {
+		case DELTA_OP_COPY:
+			if (end - d < 9)
+				goto error;
+
+			ofs = delta_get_be32(d + 1);
+			cur_len = delta_get_be32(d + 5);
+			if (ofs > base_len || cur_len > base_len - ofs ||
+			    cur_len > out_len - pos)
+				goto error;
+
+			memcpy(out + pos, old + ofs, cur_len);
+			d += 9;
+			break;
+		case DELTA_OP_DATA:
+			if (end - d < 5)
+				goto error;
+
+			cur_len = delta_get_be32(d + 1);
+			if (cur_len > end - d - 5 || cur_len > out_len - pos)
+				goto error;
+
+			memcpy(out + pos, d + 5, cur_len);
+			d += 5 + cur_len;
+			break;
+		default:
+			goto error;
+		}
+
+		pos += cur_len;
+	}
+
+	if (pos != out_len)
+		goto error;
+
+	*len = out_len;
+
+	return out;
+
+error:
+	free(out);
+	return NULL;
+}
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __UNETD_DELTA_H
+#define __UNETD_DELTA_H
+
+#include <stddef.h>
+
+/*
+ * Binary delta between two versions of a buffer, encoded as a sequence of
+ * copy (from the base) and literal data operations.
+ */
+void *delta_encode(const void *base, size_t base_len, const void *data,
+		   size_t len, size_t *delta_len);
+void *delta_apply(const void *base, size_t base_len, const void *delta,
+		  size_t delta_len, size_t max_len, size_t *len);
+
+#endif
@@ -2,12 +2,26 @@
 /*
  * Copyright (C) 2022 Felix Fietkau <nbd@nbd.name>
  */
+#include <arpa/inet.h>
 #include <libubox/avl-cmp.h>
 #include <libubox/blobmsg_json.h>
 #include "unetd.h"
 
+/* seconds */
+#define NETWORK_POLL_CONNECT_TIME	5
+#define NETWORK_POLL_INTERVAL_MAX	10
+#define NETWORK_CONNECT_BACKOFF_MAX	16
+
+/* a probed endpoint is kept for one wireguard handshake timeout */
+#define NETWORK_PROBE_HOLD_TIME		5
+
+/* handshake initiations per second, across all networks */
+#define NETWORK_CONNECT_MAX_PER_TICK	64
+
 static LIST_HEAD(old_hosts);
 static struct blob_buf b;
+static uint64_t connect_tick;
+static int connect_tick_count;
 
 static int avl_key_cmp(const void *k1, const void *k2, void *ptr)
 {
@@ -23,6 +37,120 @@ network_peer_equal(struct network_peer *p1, struct network_peer *p2)
 	       p1->port == p2->port;
 }
 
+static unsigned int
+network_peer_hash(struct network *net, const uint8_t *key)
+{
+	uint64_t id;
+
+	memcpy(&id, key, sizeof(id));
+
+	return (id * 0x9e3779b97f4a7c15ULL) >> 32 & (net->peer_hash.size - 1);
+}
+
+static void
+network_peer_hash_insert(struct network *net, struct network_peer *peer)
+{
+	unsigned int mask = net->peer_hash.size - 1;
+	unsigned int i = network_peer_hash(net, peer->key);
+
+	while (net->peer_hash.slots[i])
+		i = (i + 1) & mask;
+
+	net->peer_hash.slots[i] = peer;
+	net->peer_hash.count++;
+}
+
+static void
+network_peer_hash_resize(struct network *net)
+{
+	struct network_peer **slots = net->peer_hash.slots;
+	unsigned int i, size = net->peer_hash.size;
+
+	net->peer_hash.size = size ? size * 2 : 16;
+	net->peer_hash.slots = calloc(net->peer_hash.size, sizeof(*slots));
+	net->peer_hash.count = 0;
+
+	for (i = 0; i < size; i++)
+		if (slots[i])
+			network_peer_hash_insert(net, slots[i]);
+
+	free(slots);
+}
+
+static unsigned int
+network_peer_hash_slot(struct network *net, struct network_peer *peer)
+{
+	unsigned int mask = net->peer_hash.size - 1;
+	unsigned int i = network_peer_hash(net, peer->key);
+
+	while (net->peer_hash.slots[i] != peer)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static void
+network_peer_hash_delete(struct network *net, struct network_peer *peer)
+{
+	struct network_peer **slots = net->peer_hash.slots;
+	unsigned int mask = net->peer_hash.size - 1;
+	unsigned int i, j, k;
+
+	i = network_peer_hash_slot(net, peer);
+	slots[i] = NULL;
+	net->peer_hash.count--;
+
+	/* move back entries that would become unreachable */
+	for (j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+		k = network_peer_hash(net, slots[j]->key);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		slots[i] = slots[j];
+		slots[j] = NULL;
+		i = j;
+	}
+}
+
+static void
+network_peer_hash_update(struct network *net, struct network_peer *h_new,
+			 struct network_peer *h_old)
+{
+	if (h_new && h_old) {
+		net->peer_hash.slots[network_peer_hash_slot(net, h_old)] = h_new;
+		return;
+	}
+
+	if (h_old) {
+		network_peer_hash_delete(net, h_old);
+		return;
+	}
+
+	if ((net->peer_hash.count + 1) * 2 > net->peer_hash.size)
+		network_peer_hash_resize(net);
+
+	network_peer_hash_insert(net, h_new);
+}
+
+struct network_peer *
+network_peer_find(struct network *net, const uint8_t *key, size_t len)
+{
+	unsigned int mask = net->peer_hash.size - 1;
+	struct network_peer *peer;
+	unsigned int i;
+
+	if (!net->peer_hash.count)
+		return NULL;
+
+	for (i = network_peer_hash(net, key);
+	     (peer = net->peer_hash.slots[i]) != NULL;
+	     i = (i + 1) & mask)
+		if (!memcmp(peer->key, key, len))
+			return peer;
+
+	return NULL;
+}
+
 static void
 network_peer_update(struct vlist_tree *tree,
 		    struct vlist_node *node_new,
@@ -33,6 +161,8 @@ network_peer_update(struct vlist_tree *tree,
 	struct network_peer *h_old = container_of_safe(node_old, struct network_peer, node);
 	int ret;
 
+	network_peer_hash_update(net, h_new, h_old);
+
 	if (h_new && h_old) {
 		memcpy(&h_new->state, &h_old->state, sizeof(h_new->state));
 
@@ -41,7 +171,7 @@ network_peer_update(struct vlist_tree *tree,
 	}
 
 	if ((h_new ? h_new : h_old)->indirect)
-		return;
+		goto out;
 
 	if (h_new)
 		ret = wg_peer_update(net, h_new, h_old ? WG_PEER_UPDATE : WG_PEER_CREATE);
@@ -52,6 +182,21 @@ network_peer_update(struct vlist_tree *tree,
 		fprintf(stderr, "Failed to %s peer on network %s: %s\n",
 			h_new ? "update" : "delete", network_name(net),
 			strerror(-ret));
+
+out:
+	if (!h_new)
+		wg_peer_set_allowed_ips(h_old, NULL, 0);
+}
+
+static void
+network_peers_batch_done(struct network *net)
+{
+	int ret;
+
+	ret = wg_batch_done(net);
+	if (ret)
+		fprintf(stderr, "Failed to update peers on network %s: %s\n",
+			network_name(net), strerror(-ret));
 }
 
 static struct network_group *
@@ -113,15 +258,48 @@ static const struct blobmsg_policy host_policy[__NETWORK_HOST_MAX] = {
 	[NETWORK_HOST_META] = { "meta", BLOBMSG_TYPE_TABLE },
 };
 
+static int
+network_host_parse_prefixes(struct network_prefix *list, struct blob_attr *attr,
+			    bool subnet)
+{
+	struct blob_attr *cur;
+	int rem, n = 0;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		const char *str = blobmsg_get_string(cur);
+		struct network_prefix *p = &list[n];
+		int af, mask;
+
+		af = strchr(str, ':') ? AF_INET6 : AF_INET;
+		if (subnet) {
+			if (network_get_subnet(af, &p->addr, &mask, str))
+				continue;
+		} else {
+			if (inet_pton(af, str, &p->addr) != 1)
+				continue;
+
+			mask = af == AF_INET6 ? 128 : 32;
+		}
+
+		p->af = af;
+		p->mask = mask;
+		n++;
+	}
+
+	return n;
+}
+
 static void
 network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 {
 	struct blob_attr *tb[__NETWORK_HOST_MAX];
 	struct blob_attr *cur, *ipaddr, *subnet, *meta;
+	struct network_prefix *addrs, *subnets;
 	uint8_t key[CURVE25519_KEY_SIZE];
 	struct network_host *host = NULL;
 	struct network_peer *peer;
 	int ipaddr_len, subnet_len, meta_len;
+	int n_ipaddr = 0, n_subnet = 0;
 	const char *endpoint, *gateway;
 	char *endpoint_buf, *gateway_buf;
 	int rem;
@@ -133,13 +311,13 @@ network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 
 	ipaddr_len = tb[NETWORK_HOST_IPADDR] ? blob_pad_len(tb[NETWORK_HOST_IPADDR]) : 0;
 	if (ipaddr_len &&
-	    blobmsg_check_array(tb[NETWORK_HOST_IPADDR], BLOBMSG_TYPE_STRING) < 0)
-		ipaddr_len = 0;
+	    (n_ipaddr = blobmsg_check_array(tb[NETWORK_HOST_IPADDR], BLOBMSG_TYPE_STRING)) < 0)
+		ipaddr_len = n_ipaddr = 0;
 
 	subnet_len = tb[NETWORK_HOST_SUBNET] ? blob_pad_len(tb[NETWORK_HOST_SUBNET]) : 0;
 	if (subnet_len &&
-	    blobmsg_check_array(tb[NETWORK_HOST_SUBNET], BLOBMSG_TYPE_STRING) < 0)
-		subnet_len = 0;
+	    (n_subnet = blobmsg_check_array(tb[NETWORK_HOST_SUBNET], BLOBMSG_TYPE_STRING)) < 0)
+		subnet_len = n_subnet = 0;
 
 	meta_len = tb[NETWORK_HOST_META] ? blob_pad_len(tb[NETWORK_HOST_META]) : 0;
 	if (meta_len &&
@@ -164,7 +342,7 @@ network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 		struct network_dynamic_peer *dyn_peer;
 
 		/* don't override/alter hosts configured via network data */
-		peer = vlist_find(&net->peers, key, peer, node);
+		peer = network_peer_find(net, key, sizeof(key));
 		if (peer && !peer->dynamic &&
 			peer->node.version == net->peers.version)
 			return;
@@ -172,6 +350,8 @@ network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 		dyn_peer = calloc_a(sizeof(*dyn_peer),
 				&ipaddr, ipaddr_len,
 				&subnet, subnet_len,
+				&addrs, n_ipaddr * sizeof(*addrs),
+				&subnets, n_subnet * sizeof(*subnets),
 				&endpoint_buf, endpoint ? strlen(endpoint) + 1 : 0);
 		list_add_tail(&dyn_peer->list, &net->dynamic_peers);
 		peer = &dyn_peer->peer;
@@ -188,6 +368,8 @@ network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 				&name_buf, strlen(name) + 1,
 				&ipaddr, ipaddr_len,
 				&subnet, subnet_len,
+				&addrs, n_ipaddr * sizeof(*addrs),
+				&subnets, n_subnet * sizeof(*subnets),
 				&meta, meta_len,
 				&endpoint_buf, endpoint ? strlen(endpoint) + 1 : 0,
 				&gateway_buf, gateway ? strlen(gateway) + 1 : 0);
@@ -196,10 +378,16 @@ network_host_create(struct network *net, struct blob_attr *attr, bool dynamic)
 	}
 
 	peer->dynamic = dynamic;
-	if ((cur = tb[NETWORK_HOST_IPADDR]) != NULL && ipaddr_len)
+	if ((cur = tb[NETWORK_HOST_IPADDR]) != NULL && ipaddr_len) {
 		peer->ipaddr = memcpy(ipaddr, cur, ipaddr_len);
-	if ((cur = tb[NETWORK_HOST_SUBNET]) != NULL && subnet_len)
+		peer->addrs = addrs;
+		peer->n_addrs = network_host_parse_prefixes(addrs, cur, false);
+	}
+	if ((cur = tb[NETWORK_HOST_SUBNET]) != NULL && subnet_len) {
 		peer->subnet = memcpy(subnet, cur, subnet_len);
+		peer->subnets = subnets;
+		peer->n_subnets = network_host_parse_prefixes(subnets, cur, true);
+	}
 	if ((cur = tb[NETWORK_HOST_PORT]) != NULL)
 		peer->port = blobmsg_get_u32(cur);
 	else
@@ -297,6 +485,7 @@ void network_hosts_reload_dynamic_peers(struct network *net)
 		return;
 
 	list_splice_init(&net->dynamic_peers, &old_entries);
+	wg_batch_start(net);
 
 	vlist_for_each_element(&net->peers, peer, node)
 		if (peer->dynamic)
@@ -305,6 +494,7 @@ void network_hosts_reload_dynamic_peers(struct network *net)
 	network_hosts_load_dynamic_peers(net);
 
 	vlist_flush(&net->peers);
+	network_peers_batch_done(net);
 
 	network_host_free_dynamic_peers(&old_entries);
 }
@@ -325,6 +515,39 @@ void network_hosts_update_start(struct network *net)
 	vlist_update(&net->peers);
 }
 
+static void
+network_hosts_index_gateways(struct network *net)
+{
+	struct network_host *local = net->net_config.local_host;
+	const char *local_name = network_host_name(local);
+	struct network_host *host, *gw;
+
+	avl_for_each_element(&net->hosts, host, node) {
+		INIT_LIST_HEAD(&host->routed_hosts);
+		host->route_all = false;
+	}
+
+	avl_for_each_element(&net->hosts, host, node) {
+		if (!host->gateway)
+			continue;
+
+		/* hosts using the local host as gateway get all routes */
+		if (!strcmp(host->gateway, local_name))
+			host->route_all = true;
+
+		gw = avl_find_element(&net->hosts, host->gateway, gw, node);
+		if (gw && gw != host)
+			list_add_tail(&host->routed_list, &gw->routed_hosts);
+	}
+
+	if (!local->gateway)
+		return;
+
+	gw = avl_find_element(&net->hosts, local->gateway, gw, node);
+	if (gw)
+		gw->route_all = true;
+}
+
 static void
 __network_hosts_update_done(struct network *net, bool free_net)
 {
@@ -333,6 +556,7 @@ __network_hosts_update_done(struct network *net, bool free_net)
 	const char *local_name;
 
 	list_splice_init(&net->dynamic_peers, &old_dynamic);
+	wg_batch_start(net);
 	if (free_net)
 		goto out;
 
@@ -345,6 +569,8 @@ __network_hosts_update_done(struct network *net, bool free_net)
 	if (net->net_config.local_host_changed)
 		wg_init_local(net, &local->peer);
 
+	network_hosts_index_gateways(net);
+
 	avl_for_each_element(&net->hosts, host, node) {
 		if (host == local)
 			continue;
@@ -360,6 +586,7 @@ __network_hosts_update_done(struct network *net, bool free_net)
 
 out:
 	vlist_flush(&net->peers);
+	network_peers_batch_done(net);
 
 	network_host_free_dynamic_peers(&old_dynamic);
 
@@ -403,6 +630,191 @@ network_peer_next_endpoint(struct network_peer *peer)
 }
 
 
+static bool
+network_connect_allowed(uint64_t now)
+{
+	if (connect_tick != now) {
+		connect_tick = now;
+		connect_tick_count = 0;
+	}
+
+	return connect_tick_count < NETWORK_CONNECT_MAX_PER_TICK;
+}
+
+static void
+network_peer_set_endpoint(struct network *net, struct network_peer *peer,
+			  union network_endpoint *ep)
+{
+	if (memcmp(ep, &peer->state.endpoint, sizeof(*ep)) != 0 &&
+	    !network_skip_endpoint_route(net, ep))
+		unetd_ubus_netifd_add_route(net, ep);
+
+	wg_peer_connect(net, peer, ep);
+}
+
+static bool
+network_peer_endpoints_pending(struct network_peer *peer)
+{
+	int i = peer->state.next_endpoint_idx;
+
+	/* index 0 means that the round robin wrapped around */
+	for (; i > 0 && i < __ENDPOINT_TYPE_MAX; i++)
+		if (peer->state.next_endpoint[i].sa.sa_family)
+			return true;
+
+	return false;
+}
+
+static void
+network_peer_connect(struct network *net, struct network_peer *peer,
+		     union network_endpoint *ep, uint64_t now)
+{
+	int backoff;
+
+	network_peer_set_endpoint(net, peer, ep);
+	connect_tick_count++;
+	peer->state.last_connect = now;
+
+	/* only back off once every endpoint candidate has been tried */
+	if (network_peer_endpoints_pending(peer)) {
+		peer->state.connect_next = now + 1;
+		return;
+	}
+
+	backoff = peer->state.connect_backoff;
+	backoff = backoff ? backoff * 2 : 1;
+	if (backoff > NETWORK_CONNECT_BACKOFF_MAX)
+		backoff = NETWORK_CONNECT_BACKOFF_MAX;
+
+	peer->state.connect_backoff = backoff;
+	peer->state.connect_next = now + backoff + random() % (backoff / 2 + 1);
+}
+
+void network_peer_probe_reply(struct network *net, struct network_peer *peer,
+			      enum peer_endpoint_type type, unsigned int rtt)
+{
+	union network_endpoint *cand = peer->state.next_endpoint;
+	union network_endpoint *ep = &cand[type];
+	uint64_t now;
+	int i, n_addr = 0;
+
+	D_PEER(net, peer, "endpoint candidate %d replied, rtt=%u ms", type, rtt);
+
+	/* the reply only confirms the address, not the port */
+	for (i = 0; i < __ENDPOINT_TYPE_MAX; i++) {
+		if (!cand[i].sa.sa_family ||
+		    !network_endpoint_addr_equal(&cand[i], ep))
+			continue;
+
+		peer->state.endpoint_rtt[i] = rtt ? rtt : 1;
+		n_addr++;
+	}
+
+	if (peer->state.probe_done || peer->state.connected || peer->indirect ||
+	    !net->net_config.local_host)
+		return;
+
+	/*
+	 * first unambiguous reply wins, candidates sharing an address are
+	 * left to the round robin
+	 */
+	if (n_addr > 1 || network_endpoint_addr_equal(ep, &peer->state.endpoint))
+		return;
+
+	now = unet_gettime();
+	if (!network_connect_allowed(now))
+		return;
+
+	/* give the handshake a chance before the round robin moves on */
+	peer->state.probe_done = true;
+	peer->state.probe_hold = now + NETWORK_PROBE_HOLD_TIME;
+	network_peer_set_endpoint(net, peer, ep);
+	connect_tick_count++;
+	peer->state.last_connect = now;
+}
+
+void network_peer_set_next_endpoint(struct network *net, struct network_peer *peer,
+				    enum peer_endpoint_type type,
+				    const union network_endpoint *ep)
+{
+	union network_endpoint *cur = &peer->state.next_endpoint[type];
+	uint64_t now;
+
+	if (!memcmp(cur, ep, sizeof(*cur)))
+		return;
+
+	memcpy(cur, ep, sizeof(*cur));
+	if (peer->state.connected || peer->indirect)
+		return;
+
+	/* new endpoint, retry without waiting for the backoff */
+	peer->state.connect_backoff = 0;
+	peer->state.connect_next = 0;
+
+	now = unet_gettime();
+	if (peer->state.probe_hold > now)
+		return;
+
+	if (!net->net_config.keepalive || !net->net_config.local_host ||
+	    !network_connect_allowed(now))
+		return;
+
+	network_peer_connect(net, peer, cur, now);
+}
+
+static int
+network_peer_poll_interval(struct network *net, struct network_peer *peer,
+			   uint64_t now)
+{
+	int interval;
+
+	/*
+	 * poll quickly while a connection is being set up, but back off along
+	 * with the connect attempts of peers that keep failing to connect
+	 */
+	if (!peer->state.connected) {
+		if (peer->state.last_connect + NETWORK_POLL_CONNECT_TIME < now)
+			return NETWORK_POLL_INTERVAL_MAX;
+
+		interval = peer->state.connect_backoff;
+		if (interval < 1)
+			interval = 1;
+		if (interval > NETWORK_POLL_INTERVAL_MAX)
+			interval = NETWORK_POLL_INTERVAL_MAX;
+
+		return interval;
+	}
+
+	if (peer->state.ping_wait > 0)
+		return 1;
+
+	/* make sure the keepalive deadline is not missed */
+	interval = net->net_config.keepalive - peer->state.idle;
+	if (interval < 1)
+		interval = 1;
+	if (interval > NETWORK_POLL_INTERVAL_MAX)
+		interval = NETWORK_POLL_INTERVAL_MAX;
+
+	return interval;
+}
+
+static bool
+network_peers_refresh_due(struct network *net, uint64_t now)
+{
+	struct network_peer *peer;
+
+	vlist_for_each_element(&net->peers, peer, node) {
+		if (peer->indirect)
+			continue;
+
+		if (peer->state.last_refresh +
+		    network_peer_poll_interval(net, peer, now) <= now)
+			return true;
+	}
+
+	return false;
+}
+
 static void
 network_hosts_connect_cb(struct uloop_timeout *t)
 {
@@ -410,6 +822,7 @@ network_hosts_connect_cb(struct uloop_timeout *t)
 	struct network_host *host;
 	struct network_peer *peer;
 	union network_endpoint *ep;
+	uint64_t now;
 
 	avl_for_each_element(&net->hosts, host, node)
 		host->peer.state.num_net_queries = 0;
@@ -418,22 +831,32 @@ network_hosts_connect_cb(struct uloop_timeout *t)
 	if (!net->net_config.keepalive || !net->net_config.local_host)
 		return;
 
-	wg_peer_refresh(net);
+	/*
+	 * Neither backend can fetch the state of individual peers, so the
+	 * full peer list is only dumped when at least one peer is due.
+	 */
+	now = unet_gettime();
+	if (network_peers_refresh_due(net, now))
+		wg_peer_refresh(net);
 
+	wg_batch_start(net);
 	vlist_for_each_element(&net->peers, peer, node) {
-		if (peer->state.connected || peer->indirect)
+		if (peer->state.connected || peer->indirect ||
+		    peer->state.connect_next > now ||
+		    peer->state.probe_hold > now)
 			continue;
 
+		if (!network_connect_allowed(now))
+			break;
+
 		ep = network_peer_next_endpoint(peer);
 		if (!ep)
 			continue;
 
-		if (memcmp(ep, &peer->state.endpoint, sizeof(*ep)) != 0 &&
-		    !network_skip_endpoint_route(net, ep))
-			unetd_ubus_netifd_add_route(net, ep);
-
-		wg_peer_connect(net, peer, ep);
+		network_pex_probe_endpoints(net, peer);
+		network_peer_connect(net, peer, ep, now);
 	}
+	network_peers_batch_done(net);
 
 	network_pex_event(net, NULL, PEX_EV_QUERY);
 
@@ -463,4 +886,7 @@ void network_hosts_free(struct network *net)
 	uloop_timeout_cancel(&net->connect_timer);
 	network_hosts_update_start(net);
 	__network_hosts_update_done(net, true);
+	free(net->peer_hash.slots);
+	net->peer_hash.slots = NULL;
+	net->peer_hash.size = 0;
 }
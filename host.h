@@ -21,6 +21,12 @@ struct network_peer {
 	struct blob_attr *ipaddr;
 	struct blob_attr *subnet;
 	struct blob_attr *meta;
+
+	/* parsed from ipaddr/subnet */
+	struct network_prefix *addrs;
+	struct network_prefix *subnets;
+	int n_addrs, n_subnets;
+
 	int port;
 	int pex_port;
 	bool dynamic;
@@ -42,11 +48,42 @@ struct network_peer {
 		uint64_t last_handshake;
 		uint64_t last_request;
 		uint64_t last_query_sent;
+		uint64_t last_refresh;
+		uint64_t last_connect;
+		uint64_t connect_next;
+		int connect_backoff;
+
+		/* AllowedIPs last sent to the wireguard backend */
+		struct network_prefix *wg_ips;
+		int n_wg_ips;
+
+		/* AllowedIPs queued for the backend, not confirmed yet */
+		struct network_prefix *wg_ips_pending;
+		int n_wg_ips_pending;
+
+		/* backend state is unknown after an error, replace it */
+		bool wg_ips_replace;
 
 		int ping_wait;
 		int last_handshake_diff;
 		int idle;
 		int num_net_queries;
+
+		/* endpoint change not yet sent to other peers */
+		bool endpoint_changed;
+
+		/* highest network data version the peer has or requested */
+		uint64_t net_data_version;
+		bool announce_supported;
+
+		/* endpoint candidates probed over the global PEX port */
+		uint64_t probe_id[__ENDPOINT_TYPE_MAX];
+		uint64_t probe_sent;
+		uint64_t probe_hold;
+		bool probe_done;
+
+		/* last measured round trip time in ms, 0 if unknown */
+		unsigned int endpoint_rtt[__ENDPOINT_TYPE_MAX];
 	} state;
 };
 
@@ -61,6 +98,11 @@ struct network_host {
 
 	const char *gateway;
 	struct network_peer peer;
+
+	/* gateway index, rebuilt in network_hosts_update_done */
+	struct list_head routed_hosts;
+	struct list_head routed_list;
+	bool route_all;
 };
 
 struct network_group {
@@ -96,38 +138,59 @@ static inline const char *network_peer_name(struct network_peer *peer)
 }
 
 
-static inline bool
-network_host_uses_peer_route(struct network_host *host, struct network *net,
-			    struct network_peer *peer)
+static inline struct network_host *
+network_routed_host_next(struct network *net, struct network_peer *peer,
+			 struct network_host *host)
 {
 	struct network_host *peer_host = container_of(peer, struct network_host, peer);
-
-	if (host == peer_host || host == net->net_config.local_host)
-		return false;
-
-	if (net->net_config.local_host->gateway &&
-	    !strcmp(net->net_config.local_host->gateway, network_peer_name(peer)))
-		return true;
-
-	if (peer_host->gateway &&
-	    !strcmp(peer_host->gateway, network_host_name(net->net_config.local_host)))
-		return true;
-
-	if (!host->gateway)
-		return false;
-
-	return !strcmp(host->gateway, network_peer_name(peer));
+	struct network_host *local = net->net_config.local_host;
+	struct list_head *next;
+
+	if (peer->dynamic)
+		return NULL;
+
+	if (peer_host->route_all) {
+		do {
+			if (!host)
+				host = avl_first_element(&net->hosts, host, node);
+			else if (avl_is_last(&net->hosts, &host->node))
+				return NULL;
+			else
+				host = avl_next_element(host, node);
+		} while (host == peer_host || host == local);
+
+		return host;
+	}
+
+	do {
+		next = host ? host->routed_list.next : peer_host->routed_hosts.next;
+		if (next == &peer_host->routed_hosts)
+			return NULL;
+
+		host = container_of(next, struct network_host, routed_list);
+	} while (host == local);
+
+	return host;
 }
 
 #define for_each_routed_host(cur_host, net, peer)			\
-	avl_for_each_element(&(net)->hosts, cur_host, node)		\
-		if (network_host_uses_peer_route(host, net, peer))
-
+	for (cur_host = network_routed_host_next(net, peer, NULL);	\
+	     cur_host;							\
+	     cur_host = network_routed_host_next(net, peer, cur_host))
 
 void network_hosts_update_start(struct network *net);
 void network_hosts_update_done(struct network *net);
 void network_hosts_add(struct network *net, struct blob_attr *hosts);
 void network_hosts_reload_dynamic_peers(struct network *net);
+void network_peer_probe_reply(struct network *net, struct network_peer *peer,
+			      enum peer_endpoint_type type, unsigned int rtt);
+void network_peer_set_next_endpoint(struct network *net, struct network_peer *peer,
+				    enum peer_endpoint_type type,
+				    const union network_endpoint *ep);
+
+/* len may be shorter than the key for lookups by PEX ID, but at least 8 bytes */
+struct network_peer *network_peer_find(struct network *net, const uint8_t *key,
+				       size_t len);
 
 void network_hosts_init(struct network *net);
 void network_hosts_free(struct network *net);
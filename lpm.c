@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lpm.h"
+
+struct lpm_node {
+	struct lpm_node *child[2];
+	uint8_t key[16];
+	uint8_t len;
+	bool prefix;
+};
+
+static inline int
+lpm_bit(const uint8_t *key, int i)
+{
+	return (key[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static int
+lpm_common_len(const uint8_t *k1, const uint8_t *k2, int max)
+{
+	int i, len = 0;
+	uint8_t diff;
+
+	for (i = 0; len < max; i++, len += 8) {
+		diff = k1[i] ^ k2[i];
+		if (!diff)
+			continue;
+
+		while (!(diff & 0x80)) {
+			diff <<= 1;
+			len++;
+		}
+		break;
+	}
+
+	return len < max ? len : max;
+}
+
+static struct lpm_node *
+lpm_node_new(const uint8_t *key, int len, bool prefix)
+{
+	struct lpm_node *n = calloc(1, sizeof(*n));
+	int bytes = len / 8;
+
+	memcpy(n->key, key, bytes);
+	if (len % 8)
+		n->key[bytes] = key[bytes] & (0xff << (8 - len % 8));
+	n->len = len;
+	n->prefix = prefix;
+
+	return n;
+}
+
+void lpm_insert(struct lpm_tree *t, const void *addr, int len)
+{
+	struct lpm_node **slot = &t->root;
+	struct lpm_node *n, *mid;
+	const uint8_t *key = addr;
+	int common;
+
+	if (len > t->bits)
+		len = t->bits;
+
+	while ((n = *slot) != NULL) {
+		common = lpm_common_len(n->key, key, n->len < len ? n->len : len);
+		if (common < n->len) {
+			/* split the edge leading to n */
+			mid = lpm_node_new(key, common, common == len);
+			mid->child[lpm_bit(n->key, common)] = n;
+			if (common < len)
+				mid->child[lpm_bit(key, common)] = lpm_node_new(key, len, true);
+			*slot = mid;
+			return;
+		}
+
+		if (n->len == len) {
+			n->prefix = true;
+			return;
+		}
+
+		slot = &n->child[lpm_bit(key, n->len)];
+	}
+
+	*slot = lpm_node_new(key, len, true);
+}
+
+/* returns the length of the longest matching prefix, or -1 */
+int lpm_lookup(struct lpm_tree *t, const void *addr)
+{
+	struct lpm_node *n = t->root;
+	const uint8_t *key = addr;
+	int best = -1;
+
+	while (n) {
+		if (lpm_common_len(n->key, key, n->len) < n->len)
+			break;
+
+		if (n->prefix)
+			best = n->len;
+
+		if (n->len == t->bits)
+			break;
+
+		n = n->child[lpm_bit(key, n->len)];
+	}
+
+	return best;
+}
+
+static void
+lpm_node_free(struct lpm_node *n)
+{
+	if (!n)
+		return;
+
+	lpm_node_free(n->child[0]);
+	lpm_node_free(n->child[1]);
+	free(n);
+}
+
+void lpm_free(struct lpm_tree *t)
+{
+	lpm_node_free(t->root);
+	t->root = NULL;
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __UNETD_LPM_H
+#define __UNETD_LPM_H
+
+#include <stdbool.h>
+
+struct lpm_node;
+
+/* path compressed binary trie for longest prefix match lookups */
+struct lpm_tree {
+	struct lpm_node *root;
+	int bits;
+};
+
+static inline void lpm_init(struct lpm_tree *t, int bits)
+{
+	t->root = NULL;
+	t->bits = bits;
+}
+
+void lpm_insert(struct lpm_tree *t, const void *addr, int len);
+int lpm_lookup(struct lpm_tree *t, const void *addr);
+void lpm_free(struct lpm_tree *t);
+
+#endif
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libubox/utils.h>
+#include "lz.h"
+
+/*
+ * Format: be32 uncompressed length, followed by sequences of
+ *   token: literal length (high nibble), match length - 4 (low nibble)
+ *   [extra literal length bytes] literals
+ *   le16 match offset [extra match length bytes]
+ * Lengths of 15 are continued by bytes that are added up until one of
+ * them is < 255. The last sequence has no match part.
+ */
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+#define LZ_MAX_OFFSET	65535
+
+static uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+
+	return val;
+}
+
+static unsigned int
+lz_hash(const uint8_t *p)
+{
+	return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *
+lz_put_len(uint8_t *out, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*(out++) = 255;
+	*(out++) = len;
+
+	return out;
+}
+
+static uint8_t *
+lz_put_seq(uint8_t *out, const uint8_t *lit, size_t lit_len,
+	   size_t offset, size_t match_len)
+{
+	uint8_t *token = out++;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		out = lz_put_len(out, lit_len - 15);
+
+	memcpy(out, lit, lit_len);
+	out += lit_len;
+
+	if (!match_len)
+		return out;
+
+	*(out++) = offset & 0xff;
+	*(out++) = offset >> 8;
+
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		out = lz_put_len(out, match_len - 15);
+
+	return out;
+}
+
+void *lz_compress(const void *data, size_t len, size_t *out_len)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {};
+	const uint8_t *in = data;
+	size_t i = 0, lit = 0, match, match_len;
+	uint8_t *out, *cur;
+	uint32_t val;
+
+	/* worst case: all literals */
+	out = malloc(4 + len + len / 255 + 16);
+	val = cpu_to_be32(len);
+	memcpy(out, &val, sizeof(val));
+	cur = out + 4;
+
+	while (i + LZ_MIN_MATCH <= len) {
+		unsigned int h = lz_hash(in + i);
+
+		/* table entries are stored as position + 1, 0 means empty */
+		match = table[h];
+		table[h] = i + 1;
+		if (!match-- || i - match > LZ_MAX_OFFSET ||
+		    lz_read32(in + match) != lz_read32(in + i)) {
+			i++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (i + match_len < len && in[match + match_len] == in[i + match_len])
+			match_len++;
+
+		cur = lz_put_seq(cur, in + lit, i - lit, i - match, match_len);
+		i = lit = i + match_len;
+	}
+
+	cur = lz_put_seq(cur, in + lit, len - lit, 0, 0);
+	*out_len = cur - out;
+
+	return out;
+}
+
+static int
+lz_get_len(const uint8_t **p, const uint8_t *end, size_t *len)
+{
+	uint8_t val;
+
+	do {
+		if (*p >= end)
+			return -1;
+
+		val = *((*p)++);
+		*len += val;
+	} while (val == 255);
+
+	return 0;
+}
+
+void *lz_decompress(const void *data, size_t len, size_t max_len, size_t *out_len)
+{
+	const uint8_t *in = data, *end = in + len;
+	size_t lit_len, match_len, offset, size, pos = 0;
+	uint8_t *out, token;
+	uint32_t val;
+
+	if (len < 4)
+		return NULL;
+
+	memcpy(&val, in, sizeof(val));
+	size = be32_to_cpu(val);
+	if (!size || size > max_len)
+		return NULL;
+
+	out = malloc(size);
+	for (in += 4; in < end; ) {
+		token = *(in++);
+
+		lit_len = token >> 4;
+		if (lit_len == 15 && lz_get_len(&in, end, &lit_len))
+			goto error;
+
+		if (lit_len > end - in || lit_len > size - pos)
+			goto error;
+
+		memcpy(out + pos, in, lit_len);
+		in += lit_len;
+		pos += lit_len;
+
+		/* last sequence */
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			goto error;
+
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		match_len = token & 0xf;
+		if (match_len == 15 && lz_get_len(&in, end, &match_len))
+			goto error;
+
+		match_len += LZ_MIN_MATCH;
+		if (!offset || offset > pos || match_len > size - pos)
+			goto error;
+
+		/* may overlap, copy byte by byte */
+		for (; match_len; match_len--, pos++)
+			out[pos] = out[pos - offset];
+	}
+
+	if (pos != size)
+		goto error;
+
+	*out_len = size;
+
+	return out;
+
+error:
+	free(out);
+	return NULL;
+}
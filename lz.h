@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __UNETD_LZ_H
+#define __UNETD_LZ_H
+
+#include <stddef.h>
+
+/* small LZ77 codec (LZ4 style sequences) for network data transfers */
+void *lz_compress(const void *data, size_t len, size_t *out_len);
+void *lz_decompress(const void *data, size_t len, size_t max_len, size_t *out_len);
+
+#endif
@@ -8,6 +8,7 @@
 #include <libubox/uloop.h>
 #include <libubox/blobmsg_json.h>
 #include "unetd.h"
+#include "random.h"
 
 struct cmdline_network {
 	struct cmdline_network *next;
@@ -170,6 +171,7 @@ int main(int argc, char **argv)
 {
 	struct cmdline_network *net;
 	const char *unix_socket = NULL;
+	unsigned int seed;
 	int ch;
 
 	while ((ch = getopt(argc, argv, "D:dh:u:M:N:P:")) != -1) {
@@ -201,6 +203,10 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* used for connect backoff jitter */
+	randombytes(&seed, sizeof(seed));
+	srandom(seed);
+
 	uloop_init();
 #ifdef UBUS_SUPPORT
 	udebug_init(&ud);
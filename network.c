@@ -60,6 +60,7 @@ const struct blobmsg_policy network_policy[__NETWORK_ATTR_MAX] = {
 	[NETWORK_ATTR_LOCAL_NET] = { "local_network", BLOBMSG_TYPE_ARRAY },
 	[NETWORK_ATTR_AUTH_CONNECT] = { "auth_connect", BLOBMSG_TYPE_ARRAY },
 	[NETWORK_ATTR_PEER_DATA] = { "peer_data", BLOBMSG_TYPE_ARRAY },
+	[NETWORK_ATTR_DATA_SIZE_MAX] = { "data_size_max", BLOBMSG_TYPE_INT32 },
 };
 
 AVL_TREE(networks, avl_strcmp, false, NULL);
@@ -140,12 +141,46 @@ static int network_load_file(struct network *net)
 	return network_load_data(net, b.head);
 }
 
+static void
+network_free_data_enc(struct network *net)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(net->net_data_enc); i++) {
+		free(net->net_data_enc[i].data);
+		net->net_data_enc[i].data = NULL;
+		net->net_data_enc[i].len = 0;
+	}
+}
+
+void network_set_data(struct network *net, void *data, size_t len, uint64_t version)
+{
+	/* update responses in progress send from the buffers freed here */
+	network_pex_updates_free(net);
+	network_free_data_enc(net);
+
+	if (net->net_data_len && net->net_data_version != version) {
+		free(net->net_data_prev);
+		net->net_data_prev = net->net_data;
+		net->net_data_prev_len = net->net_data_len;
+		net->net_data_prev_version = net->net_data_version;
+	} else {
+		free(net->net_data);
+	}
+
+	net->net_data = data;
+	net->net_data_len = len;
+	net->net_data_version = version;
+}
+
 static int network_load_dynamic(struct network *net)
 {
 	const char *json = NULL;
 	char *fname = NULL;
+	uint64_t version;
 	struct stat st;
 	FILE *f = NULL;
+	void *data;
 	int ret = -1;
 
 	if (asprintf(&fname, "%s/%s.bin", data_dir, network_name(net)) < 0)
@@ -162,16 +197,17 @@ static int network_load_dynamic(struct network *net)
 	if (fstat(fileno(f), &st) < 0)
 		goto out;
 
-	net->net_data_len = st.st_size;
-	net->net_data = realloc(net->net_data, net->net_data_len + 1);
-	memset(net->net_data + net->net_data_len, 0, 1);
-	if (fread(net->net_data, 1, net->net_data_len, f) != net->net_data_len ||
-	    unet_auth_data_validate(net->config.auth_key, net->net_data,
-				    net->net_data_len, &net->net_data_version, &json)) {
+	data = calloc(1, st.st_size + 1);
+	if (fread(data, 1, st.st_size, f) != st.st_size ||
+	    unet_auth_data_validate(net->config.auth_key, data, st.st_size,
+				    &version, &json)) {
+		free(data);
 		net->net_data_len = 0;
 		goto out;
 	}
 
+	network_set_data(net, data, st.st_size, version);
+
 	fclose(f);
 	blob_buf_init(&b, 0);
 	if (!blobmsg_add_json_from_string(&b, json)) {
@@ -255,24 +291,22 @@ network_fill_ip(struct blob_buf *buf, int af, union network_addr *addr, int mask
 static void
 network_fill_ipaddr_list(struct network_host *host, struct blob_buf *b, bool ipv6)
 {
-	union network_addr addr = {};
-	struct blob_attr *cur;
+	struct network_peer *peer = &host->peer;
+	int af = ipv6 ? AF_INET6 : AF_INET;
+	char *str;
 	void *c;
-	int rem;
-	int af;
-
-	af = ipv6 ? AF_INET6 : AF_INET;
-	blobmsg_for_each_attr(cur, host->peer.ipaddr, rem) {
-		const char *str = blobmsg_get_string(cur);
+	int i;
 
-		if (!!strchr(str, ':') != ipv6)
-			continue;
+	for (i = 0; i < peer->n_addrs; i++) {
+		struct network_prefix *p = &peer->addrs[i];
 
-		if (inet_pton(af, str, &addr) != 1)
+		if (p->af != af)
 			continue;
 
 		c = blobmsg_open_table(b, NULL);
-		blobmsg_add_string(b, "ipaddr", str);
+		str = blobmsg_alloc_string_buffer(b, "ipaddr", INET6_ADDRSTRLEN);
+		inet_ntop(af, &p->addr, str, INET6_ADDRSTRLEN);
+		blobmsg_add_string_buffer(b);
 		blobmsg_add_string(b, "mask", ipv6 ? "128" : "32");
 		blobmsg_close_table(b, c);
 	}
@@ -295,51 +329,37 @@ network_fill_ip_settings(struct network *net, struct blob_buf *buf)
 }
 
 static void
-__network_fill_host_subnets(struct network_host *host, struct blob_buf *b, bool ipv6)
+__network_fill_prefix_routes(struct blob_buf *b, struct network_prefix *list,
+			     int n, int af)
 {
-	union network_addr addr = {};
-	struct blob_attr *cur;
+	char *buf;
 	void *c;
-	int af;
-	int mask;
-	int rem;
+	int i;
 
-	af = ipv6 ? AF_INET6 : AF_INET;
-	blobmsg_for_each_attr(cur, host->peer.subnet, rem) {
-		const char *str = blobmsg_get_string(cur);
-		char *buf;
-
-		if (!!strchr(str, ':') != ipv6)
-			continue;
-
-		if (network_get_subnet(af, &addr, &mask, str))
+	for (i = 0; i < n; i++) {
+		if (list[i].af != af)
 			continue;
 
 		c = blobmsg_open_table(b, NULL);
 
 		buf = blobmsg_alloc_string_buffer(b, "target", INET6_ADDRSTRLEN);
-		inet_ntop(af, &addr, buf, INET6_ADDRSTRLEN);
+		inet_ntop(af, &list[i].addr, buf, INET6_ADDRSTRLEN);
 		blobmsg_add_string_buffer(b);
 
-		blobmsg_printf(b, "netmask", "%d", mask);
+		blobmsg_printf(b, "netmask", "%d", list[i].mask);
 
 		blobmsg_close_table(b, c);
 	}
+}
 
-	blobmsg_for_each_attr(cur, host->peer.ipaddr, rem) {
-		const char *str = blobmsg_get_string(cur);
-
-		if (!!strchr(str, ':') != ipv6)
-			continue;
-
-		if (inet_pton(af, str, &addr) != 1)
-			continue;
+static void
+__network_fill_host_subnets(struct network_host *host, struct blob_buf *b, bool ipv6)
+{
+	struct network_peer *peer = &host->peer;
+	int af = ipv6 ? AF_INET6 : AF_INET;
 
-		c = blobmsg_open_table(b, NULL);
-		blobmsg_add_string(b, "target", str);
-		blobmsg_add_string(b, "netmask", ipv6 ? "128" : "32");
-		blobmsg_close_table(b, c);
-	}
+	__network_fill_prefix_routes(b, peer->subnets, peer->n_subnets, af);
+	__network_fill_prefix_routes(b, peer->addrs, peer->n_addrs, af);
 }
 
 static void
@@ -365,84 +385,49 @@ network_fill_subnets(struct network *net, struct blob_buf *buf)
 	__network_fill_subnets(net, buf, true);
 }
 
-static bool
-__network_skip_endpoint_route(struct network *net, struct network_host *host,
-			      union network_endpoint *ep)
+static void
+network_addr_lpm_add(struct network *net, struct network_prefix *p)
 {
-	bool ipv6 = ep->sa.sa_family == AF_INET6;
-	uint32_t *subnet32, *addr32, mask32;
-	union network_addr addr = {};
-	struct blob_attr *cur;
-	int mask, rem;
-
-	blobmsg_for_each_attr(cur, host->peer.ipaddr, rem) {
-		const char *str = blobmsg_get_string(cur);
-
-		if (!!strchr(str, ':') != ipv6)
-			continue;
-
-		if (inet_pton(ep->sa.sa_family, str, &addr) != 1)
-			continue;
-
-		if (ipv6) {
-			if (!memcmp(&addr.in6, &ep->in6.sin6_addr, sizeof(addr.in6)))
-				return true;
-		} else {
-			if (!memcmp(&addr.in, &ep->in.sin_addr, sizeof(addr.in)))
-				return true;
-		}
-	}
-
-	if (ipv6)
-		addr32 = (uint32_t *)&ep->in6.sin6_addr;
+	if (p->af == AF_INET6)
+		lpm_insert(&net->host_addr6, &p->addr, p->mask);
 	else
-		addr32 = (uint32_t *)&ep->in.sin_addr;
-
-	subnet32 = (uint32_t *)&addr;
-	blobmsg_for_each_attr(cur, host->peer.subnet, rem) {
-		const char *str = blobmsg_get_string(cur);
-		int i;
-
-		if (!!strchr(str, ':') != ipv6)
-			continue;
-
-		if (network_get_subnet(ep->sa.sa_family, &addr, &mask, str))
-			continue;
+		lpm_insert(&net->host_addr4, &p->addr, p->mask);
+}
 
-		if (mask <= 1)
-			continue;
+static void
+network_addr_lpm_build(struct network *net)
+{
+	struct network_host *host;
+	struct network_peer *peer;
+	int i;
 
-		for (i = 0; i < (ipv6 ? 4 : 1); i++) {
-			int cur_mask = mask > 32 ? 32 : mask;
+	lpm_free(&net->host_addr4);
+	lpm_free(&net->host_addr6);
 
-			if (mask > 32)
-				mask -= 32;
-			else
-				mask = 0;
+	avl_for_each_element(&net->hosts, host, node) {
+		peer = &host->peer;
 
-			mask32 = ~0ULL << (32 - cur_mask);
-			if (ntohl(subnet32[i] ^ addr32[i]) & mask32)
-				continue;
-		}
+		for (i = 0; i < peer->n_addrs; i++)
+			network_addr_lpm_add(net, &peer->addrs[i]);
 
-		return true;
+		for (i = 0; i < peer->n_subnets; i++)
+			if (peer->subnets[i].mask > 1)
+				network_addr_lpm_add(net, &peer->subnets[i]);
 	}
-
-	return false;
 }
 
 bool network_skip_endpoint_route(struct network *net, union network_endpoint *ep)
 {
-	struct network_host *host;
+	struct lpm_tree *t;
 
-	avl_for_each_element(&net->hosts, host, node)
-		if (__network_skip_endpoint_route(net, host, ep))
-			return true;
+	if (ep->sa.sa_family == AF_INET6)
+		t = &net->host_addr6;
+	else
+		t = &net->host_addr4;
 
-	return false;
+	return lpm_lookup(t, network_endpoint_addr(ep, NULL)) >= 0;
 }
 
-
 static void
 network_do_update(struct network *net, bool up)
 {
@@ -491,10 +476,11 @@ static void network_reload(struct uloop_timeout *t)
 
 	net->prev_local_host = net->net_config.local_host;
 
+	network_stun_update_start(net);
+	network_pex_suspend(net);
+
 	memset(&net->net_config, 0, sizeof(net->net_config));
 
-	network_stun_free(net);
-	network_pex_close(net);
 	network_services_free(net);
 	network_hosts_update_start(net);
 	network_services_update_start(net);
@@ -513,6 +499,8 @@ static void network_reload(struct uloop_timeout *t)
 
 	network_services_update_done(net);
 	network_hosts_update_done(net);
+	network_stun_update_done(net);
+	network_addr_lpm_build(net);
 	uloop_timeout_set(&net->connect_timer, 10);
 
 	net->prev_local_host = NULL;
@@ -573,6 +561,8 @@ static void network_teardown(struct network *net)
 	network_hosts_free(net);
 	network_services_free(net);
 	wg_cleanup_network(net);
+	lpm_free(&net->host_addr4);
+	lpm_free(&net->host_addr6);
 }
 
 static void
@@ -581,6 +571,8 @@ network_destroy(struct network *net)
 	network_teardown(net);
 	avl_delete(&networks, &net->node);
 	free(net->net_data);
+	free(net->net_data_prev);
+	network_free_data_enc(net);
 	free(net->config.data);
 	free(net);
 }
@@ -634,6 +626,12 @@ network_set_config(struct network *net, struct blob_attr *config)
 	else
 		net->config.keepalive = -1;
 
+	net->config.data_size_max = UNETD_NET_DATA_SIZE_MAX;
+	if ((cur = tb[NETWORK_ATTR_DATA_SIZE_MAX]) != NULL)
+		net->config.data_size_max = blobmsg_get_u32(cur);
+	if (net->config.data_size_max > UNETD_NET_DATA_SIZE_LIMIT)
+		net->config.data_size_max = UNETD_NET_DATA_SIZE_LIMIT;
+
 	switch (net->config.type) {
 	case NETWORK_TYPE_FILE:
 		if ((cur = tb[NETWORK_ATTR_FILE]) != NULL)
@@ -715,6 +713,8 @@ network_alloc(const char *name)
 	net->node.key = strcpy(name_buf, name);
 	net->reload_timer.cb = network_reload;
 	avl_insert(&networks, &net->node);
+	lpm_init(&net->host_addr4, 32);
+	lpm_init(&net->host_addr6, 128);
 
 	network_pex_init(net);
 	network_stun_init(net);
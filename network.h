@@ -28,6 +28,7 @@ struct network {
 		struct blob_attr *data;
 		enum network_type type;
 		int keepalive;
+		size_t data_size_max;
 		uint8_t key[CURVE25519_KEY_SIZE];
 		uint8_t pubkey[CURVE25519_KEY_SIZE];
 		uint8_t auth_key[CURVE25519_KEY_SIZE];
@@ -56,6 +57,16 @@ struct network {
 	void *net_data;
 	size_t net_data_len;
 	uint64_t net_data_version;
+
+	/* previous version and encoded copies of the current one, for update
+	 * requests. net_data_enc is indexed by PEX_UPDATE_F_* flags */
+	void *net_data_prev;
+	size_t net_data_prev_len;
+	uint64_t net_data_prev_version;
+	struct network_data_enc {
+		void *data;
+		size_t len;
+	} net_data_enc[4];
 	int num_net_queries;
 	unsigned int update_refused;
 
@@ -68,6 +79,15 @@ struct network {
 	struct avl_tree hosts;
 	struct vlist_tree peers;
 
+	/* open addressing index of peers, keyed by the first 8 key bytes */
+	struct {
+		struct network_peer **slots;
+		unsigned int size, count;
+	} peer_hash;
+
+	/* host addresses and subnets, used to skip endpoint routes */
+	struct lpm_tree host_addr4, host_addr6;
+
 	struct avl_tree groups;
 	struct vlist_tree services;
 
@@ -92,6 +112,7 @@ enum {
 	NETWORK_ATTR_LOCAL_NET,
 	NETWORK_ATTR_AUTH_CONNECT,
 	NETWORK_ATTR_PEER_DATA,
+	NETWORK_ATTR_DATA_SIZE_MAX,
 	__NETWORK_ATTR_MAX,
 };
 
@@ -107,6 +128,7 @@ void network_get_config(struct network *net, struct blob_buf *buf);
 bool network_skip_endpoint_route(struct network *net, union network_endpoint *ep);
 void network_fill_host_addr(union network_addr *addr, uint8_t *key);
 int network_save_dynamic(struct network *net);
+void network_set_data(struct network *net, void *data, size_t len, uint64_t version);
 void network_soft_reload(struct network *net);
 void network_free_all(void);
 
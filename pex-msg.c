@@ -2,6 +2,7 @@
 /*
  * Copyright (C) 2022 Felix Fietkau <nbd@nbd.name>
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -15,6 +16,8 @@
 #include "pex-msg.h"
 #include "chacha20.h"
 #include "auth-data.h"
+#include "delta.h"
+#include "lz.h"
 
 static char pex_tx_buf[PEX_BUF_SIZE];
 static struct uloop_fd pex_fd, pex_unix_fd;
@@ -26,6 +29,120 @@ static pex_recv_cb_t pex_recv_cb;
 static pex_recv_control_cb_t pex_control_cb;
 static int pex_unix_tx_fd = -1;
 
+/* outgoing datagrams, sent with sendmmsg at the end of the uloop iteration */
+#define PEX_TX_QUEUE_LEN	32
+
+struct pex_tx_entry {
+	int fd;
+	socklen_t addr_len;
+	struct sockaddr_in6 addr;
+	size_t len;
+	char buf[PEX_BUF_SIZE];
+};
+
+static struct pex_tx_entry pex_tx_queue[PEX_TX_QUEUE_LEN];
+static int pex_tx_queue_len;
+
+/*
+ * ephemeral keys for update responses, generated ahead of time so that
+ * only the DH remains on the request path. Each key is used once.
+ */
+#define PEX_EKEY_POOL_SIZE	32
+#define PEX_EKEY_POOL_BATCH	4
+#define PEX_EKEY_POOL_DELAY	100
+
+struct pex_ekey {
+	uint8_t priv[CURVE25519_KEY_SIZE];
+	uint8_t pub[CURVE25519_KEY_SIZE];
+};
+
+static struct pex_ekey pex_ekey_pool[PEX_EKEY_POOL_SIZE];
+static int pex_ekey_pool_len;
+static struct uloop_timeout pex_ekey_timer;
+
+void pex_msg_flush(void)
+{
+	struct mmsghdr msg[PEX_TX_QUEUE_LEN] = {};
+	struct iovec iov[PEX_TX_QUEUE_LEN];
+	int i, n, fd, ret;
+
+	for (i = 0; i < pex_tx_queue_len; i++) {
+		struct pex_tx_entry *e = &pex_tx_queue[i];
+
+		iov[i].iov_base = e->buf;
+		iov[i].iov_len = e->len;
+		msg[i].msg_hdr.msg_name = &e->addr;
+		msg[i].msg_hdr.msg_namelen = e->addr_len;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	i = 0;
+	while (i < pex_tx_queue_len) {
+		fd = pex_tx_queue[i].fd;
+		for (n = i + 1; n < pex_tx_queue_len; n++)
+			if (pex_tx_queue[n].fd != fd)
+				break;
+
+		while (i < n) {
+			ret = sendmmsg(fd, &msg[i], n - i, 0);
+			if (ret > 0) {
+				i += ret;
+				continue;
+			}
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			/* drop the rest of the batch if the socket is full */
+			if (ret < 0 && errno == EAGAIN) {
+				fprintf(stderr, "sendmmsg: %s, dropped %d packets\n",
+					strerror(errno), n - i);
+				i = n;
+			} else {
+				fprintf(stderr, "sendmmsg: %s, dropped 1 packet\n",
+					ret < 0 ? strerror(errno) : "no progress");
+				i++;
+			}
+		}
+	}
+
+	pex_tx_queue_len = 0;
+}
+
+static void
+pex_tx_timer_cb(struct uloop_timeout *t)
+{
+	pex_msg_flush();
+}
+
+static struct uloop_timeout pex_tx_timer = {
+	.cb = pex_tx_timer_cb,
+};
+
+static int
+pex_msg_queue(int fd, const void *data, size_t len, const void *addr,
+	      socklen_t addr_len)
+{
+	struct pex_tx_entry *e;
+
+	if (len > sizeof(e->buf) || addr_len > sizeof(e->addr))
+		return sendto(fd, data, len, 0, addr, addr_len);
+
+	if (pex_tx_queue_len == ARRAY_SIZE(pex_tx_queue))
+		pex_msg_flush();
+
+	e = &pex_tx_queue[pex_tx_queue_len++];
+	e->fd = fd;
+	e->len = len;
+	e->addr_len = addr_len;
+	memcpy(e->buf, data, len);
+	memcpy(&e->addr, addr, addr_len);
+	uloop_timeout_set(&pex_tx_timer, 0);
+
+	return len;
+}
+
 int pex_socket(void)
 {
 	return pex_fd.fd;
@@ -55,20 +172,51 @@ get_mapped_sockaddr(const void *addr)
 	return &sin6;
 }
 
+/* limits for tracking received parts of an update response */
+#define PEX_UPDATE_RANGES_MAX		256
+#define PEX_UPDATE_RESEND_MAX		5
+#define PEX_UPDATE_COOKIE_MAX		3
+
+struct pex_msg_update_range {
+	uint32_t start, end;
+};
+
 struct pex_msg_update_recv_ctx {
 	struct list_head list;
 
 	union network_endpoint addr;
 
+	uint8_t pubkey[CURVE25519_KEY_SIZE];
 	uint8_t priv_key[CURVE25519_KEY_SIZE];
 	uint8_t auth_key[CURVE25519_KEY_SIZE];
 	uint8_t e_key[CURVE25519_KEY_SIZE];
 
+	/* derived once the response header is accepted */
+	uint8_t enc_key[CURVE25519_KEY_SIZE];
+
 	uint64_t req_id;
+	uint64_t cur_version;
+	bool ext;
+	uint32_t flags;
+	int cookie_replies;
 
 	void *data;
 	int data_len;
-	int data_ofs;
+	size_t data_size;
+	size_t max_len;
+
+	/*
+	 * chunks are decrypted on arrival, plain data is validated up to
+	 * this offset and must not be modified below it
+	 */
+	struct edsign_verify_state vst;
+	uint32_t verified;
+
+	/* sorted, non-overlapping ranges of data received so far */
+	struct pex_msg_update_range *ranges;
+	int n_ranges;
+	bool partial;
+	int resend;
 
 	int idle;
 };
@@ -144,73 +292,72 @@ void *pex_msg_append(size_t len)
 }
 
 static void
-pex_fd_cb(struct uloop_fd *fd, unsigned int events)
+pex_fd_recv(void *buf, size_t len, struct sockaddr_in6 *sin6)
 {
-	static struct sockaddr_in6 sin6;
-	static char buf[PEX_RX_BUF_SIZE];
-	ssize_t len;
+	struct iovec iov[2] = {
+		{ .iov_base = sin6, .iov_len = sizeof(*sin6) },
+		{ .iov_base = buf, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = ARRAY_SIZE(iov),
+	};
 
-	while (1) {
-		static struct iovec iov[2] = {
-			{ .iov_base = &sin6 },
-			{ .iov_base = buf },
-		};
-		static struct msghdr msg = {
-			.msg_iov = iov,
-			.msg_iovlen = ARRAY_SIZE(iov),
-		};
-		socklen_t slen = sizeof(sin6);
+	if (!len)
+		return;
 
-		len = recvfrom(fd->fd, buf, sizeof(buf), 0, (struct sockaddr *)&sin6, &slen);
-		if (len < 0) {
-			if (errno == EINTR)
-				continue;
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)sin6;
+		struct in_addr in = *(struct in_addr *)&sin6->sin6_addr.s6_addr[12];
+		int port = sin6->sin6_port;
 
-			if (errno == EAGAIN)
-				break;
+		memset(sin6, 0, sizeof(*sin6));
+		sin->sin_port = port;
+		sin->sin_family = AF_INET;
+		sin->sin_addr = in;
+		iov[0].iov_len = sizeof(*sin);
+	}
 
-			pex_close();
-			return;
+retry:
+	if (pex_unix_tx_fd >= 0) {
+		if (sendmsg(pex_unix_tx_fd, &msg, 0) < 0) {
+			switch (errno) {
+			case EINTR:
+				goto retry;
+			case EMSGSIZE:
+			case ENOBUFS:
+			case EAGAIN:
+				return;
+			default:
+				perror("sendmsg");
+				close(pex_unix_tx_fd);
+				pex_unix_tx_fd = -1;
+				break;
+			}
 		}
+	}
 
-		if (!len)
-			continue;
-
-		if (IN6_IS_ADDR_V4MAPPED(&sin6.sin6_addr)) {
-			struct sockaddr_in *sin = (struct sockaddr_in *)&sin6;
-			struct in_addr in = *(struct in_addr *)&sin6.sin6_addr.s6_addr[12];
-			int port = sin6.sin6_port;
-
-			memset(&sin6, 0, sizeof(sin6));
-			sin->sin_port = port;
-			sin->sin_family = AF_INET;
-			sin->sin_addr = in;
-			slen = sizeof(*sin);
-		}
+	pex_recv_cb(buf, len, sin6);
+}
 
-retry:
-		if (pex_unix_tx_fd >= 0) {
-			iov[0].iov_len = slen;
-			iov[1].iov_len = len;
-			if (sendmsg(pex_unix_tx_fd, &msg, 0) < 0) {
-				switch (errno) {
-				case EINTR:
-					goto retry;
-				case EMSGSIZE:
-				case ENOBUFS:
-				case EAGAIN:
-					continue;
-				default:
-					perror("sendmsg");
-					close(pex_unix_tx_fd);
-					pex_unix_tx_fd = -1;
-					break;
-				}
-			}
+static void
+pex_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	static struct sockaddr_in6 addr[UDP_RX_BATCH];
+	static char buf[UDP_RX_BATCH][PEX_RX_BUF_SIZE];
+	size_t len[UDP_RX_BATCH];
+	int i, n;
+
+	do {
+		n = udp_recv_batch(fd->fd, buf, sizeof(buf[0]), len, addr, UDP_RX_BATCH);
+		if (n < 0) {
+			pex_close();
+			return;
 		}
 
-		pex_recv_cb(buf, len, &sin6);
-	}
+		for (i = 0; i < n; i++)
+			pex_fd_recv(buf[i], len[i], &addr[i]);
+	} while (n == UDP_RX_BATCH);
 }
 
 static void
@@ -289,11 +436,16 @@ pex_unix_cb(struct uloop_fd *fd, unsigned int events)
 			continue;
 
 		sa = get_mapped_sockaddr(sa);
-		sendto(pex_fd.fd, buf + slen, len - slen, 0, sa, sizeof(struct sockaddr_in6));
+		pex_msg_queue(pex_fd.fd, buf + slen, len - slen, sa, sizeof(struct sockaddr_in6));
 	}
 }
 
 
+/*
+ * Datagrams to an address are queued and sent from pex_msg_flush, which
+ * logs transmit errors itself. A negative return only reports that the
+ * message could not be handed off, e.g. because no socket is available.
+ */
 int __pex_msg_send(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen)
 {
 	struct pex_hdr *hdr = (struct pex_hdr *)pex_tx_buf;
@@ -311,8 +463,11 @@ int __pex_msg_send(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen)
 			sa = addr = get_mapped_sockaddr(addr);
 		}
 
-		if (fd < 0)
+		if (fd < 0) {
+			hdr->len = orig_len;
+			errno = EBADF;
 			return -1;
+		}
 	}
 
 	hdr->len = htons(hdr->len);
@@ -326,7 +481,7 @@ int __pex_msg_send(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen)
 		else
 			addr_len = sizeof(struct sockaddr_in);
 
-		ret = sendto(fd, pex_tx_buf, tx_len, 0, addr, addr_len);
+		ret = pex_msg_queue(fd, pex_tx_buf, tx_len, addr, addr_len);
 	} else {
 		ret = send(fd, pex_tx_buf, tx_len, 0);
 	}
@@ -341,80 +496,151 @@ pex_msg_update_response_fill(struct pex_msg_update_send_ctx *ctx)
 	struct pex_hdr *hdr = (struct pex_hdr *)pex_tx_buf;
 	int ofs = hdr->len + sizeof(struct pex_hdr);
 	int cur_len = ctx->rem;
+	void *buf;
 
 	if (cur_len > PEX_BUF_SIZE - ofs)
 		cur_len = PEX_BUF_SIZE - ofs;
 
-	memcpy(pex_msg_append(cur_len), ctx->cur, cur_len);
+	/* encrypted in the tx buffer, keystream seeked to the chunk offset */
+	buf = pex_msg_append(cur_len);
+	memcpy(buf, ctx->cur, cur_len);
+	chacha20_encrypt_msg_at(buf, cur_len, &ctx->req_id, ctx->enc_key,
+				ctx->cur - ctx->data);
 	ctx->cur += cur_len;
 	ctx->rem -= cur_len;
 }
 
+static void
+pex_ekey_generate(struct pex_ekey *key)
+{
+	randombytes(key->priv, sizeof(key->priv));
+	curve25519_clamp_secret(key->priv);
+	curve25519_generate_public(key->pub, key->priv);
+}
+
+static void
+pex_ekey_pool_cb(struct uloop_timeout *t)
+{
+	int i;
+
+	/* refill in small steps to avoid stalling the loop */
+	for (i = 0; i < PEX_EKEY_POOL_BATCH &&
+		    pex_ekey_pool_len < PEX_EKEY_POOL_SIZE; i++)
+		pex_ekey_generate(&pex_ekey_pool[pex_ekey_pool_len++]);
+
+	if (pex_ekey_pool_len < PEX_EKEY_POOL_SIZE)
+		uloop_timeout_set(t, 1);
+}
+
+static void
+pex_ekey_get(struct pex_ekey *key)
+{
+	if (pex_ekey_pool_len > 0) {
+		struct pex_ekey *cur = &pex_ekey_pool[--pex_ekey_pool_len];
+
+		memcpy(key, cur, sizeof(*key));
+		memset(cur, 0, sizeof(*cur));
+	} else {
+		pex_ekey_generate(key);
+	}
+
+	/* wait for bursts of requests to be handled before refilling */
+	if (pex_ekey_timer.cb && !pex_ekey_timer.pending)
+		uloop_timeout_set(&pex_ekey_timer, PEX_EKEY_POOL_DELAY);
+}
+
 void pex_msg_update_response_init(struct pex_msg_update_send_ctx *ctx,
 				  const uint8_t *pubkey, const uint8_t *auth_key,
 				  const uint8_t *peer_key, bool ext,
 				  struct pex_update_request *req,
 				  const void *data, int len)
 {
-	uint8_t e_key_priv[CURVE25519_KEY_SIZE];
-	uint8_t enc_key[CURVE25519_KEY_SIZE];
-	struct pex_update_response *res;
+	struct pex_ekey e_key;
 
 	ctx->pubkey = pubkey;
 	ctx->auth_key = auth_key;
 	ctx->ext = ext;
 	ctx->req_id = req->req_id;
 
-	if (!__pex_msg_init_ext(pubkey, auth_key, PEX_MSG_UPDATE_RESPONSE, ext))
-		return;
-
-	res = pex_msg_append(sizeof(*res));
-	res->req_id = req->req_id;
-	res->data_len = cpu_to_be32(len);
-
-	randombytes(e_key_priv, sizeof(e_key_priv));
-
-	curve25519_clamp_secret(e_key_priv);
-	curve25519_generate_public(res->e_key, e_key_priv);
-	curve25519(enc_key, e_key_priv, peer_key);
-
-	ctx->data = ctx->cur = malloc(len);
-	ctx->rem = len;
+	pex_ekey_get(&e_key);
+	memcpy(ctx->e_key, e_key.pub, sizeof(ctx->e_key));
+	curve25519(ctx->enc_key, e_key.priv, peer_key);
+	memset(&e_key, 0, sizeof(e_key));
 
-	memcpy(ctx->data, data, len);
-	chacha20_encrypt_msg(ctx->data, len, &req->req_id, enc_key);
+	ctx->data = ctx->cur = data;
+	ctx->len = ctx->rem = len;
 
-	pex_msg_update_response_fill(ctx);
+	pex_msg_update_response_continue(ctx);
 }
 
 bool pex_msg_update_response_continue(struct pex_msg_update_send_ctx *ctx)
 {
 	struct pex_update_response_data *res_ext;
+	struct pex_update_response *res;
 
-	if (ctx->rem <= 0) {
-		free(ctx->data);
-		ctx->data = NULL;
-
+	if (ctx->rem <= 0)
 		return false;
-	}
 
-	if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
-				PEX_MSG_UPDATE_RESPONSE_DATA, ctx->ext))
-		return false;
+	/* the first chunk carries the response header */
+	if (ctx->cur == ctx->data && ctx->flags) {
+		struct pex_update_response_encoded *enc;
+
+		if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
+					PEX_MSG_UPDATE_RESPONSE_ENCODED, ctx->ext))
+			return false;
+
+		enc = pex_msg_append(sizeof(*enc));
+		enc->req_id = ctx->req_id;
+		enc->data_len = cpu_to_be32(ctx->len);
+		enc->flags = cpu_to_be32(ctx->flags);
+		memcpy(enc->e_key, ctx->e_key, sizeof(enc->e_key));
+	} else if (ctx->cur == ctx->data) {
+		if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
+					PEX_MSG_UPDATE_RESPONSE, ctx->ext))
+			return false;
+
+		res = pex_msg_append(sizeof(*res));
+		res->req_id = ctx->req_id;
+		res->data_len = cpu_to_be32(ctx->len);
+		memcpy(res->e_key, ctx->e_key, sizeof(res->e_key));
+	} else {
+		if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
+					PEX_MSG_UPDATE_RESPONSE_DATA, ctx->ext))
+			return false;
+
+		res_ext = pex_msg_append(sizeof(*res_ext));
+		res_ext->req_id = ctx->req_id;
+		res_ext->offset = cpu_to_be32(ctx->cur - ctx->data);
+	}
 
-	res_ext = pex_msg_append(sizeof(*res_ext));
-	res_ext->req_id = ctx->req_id;
-	res_ext->offset = cpu_to_be32(ctx->cur - ctx->data);
 	pex_msg_update_response_fill(ctx);
 
 	return true;
 }
 
+void pex_msg_update_response_seek(struct pex_msg_update_send_ctx *ctx,
+				  uint32_t offset, uint32_t len)
+{
+	if (offset > ctx->len)
+		offset = ctx->len;
+	if (len > ctx->len - offset)
+		len = ctx->len - offset;
+
+	ctx->cur = ctx->data + offset;
+	ctx->rem = len;
+}
+
+void pex_msg_update_response_free(struct pex_msg_update_send_ctx *ctx)
+{
+	memset(ctx->enc_key, 0, sizeof(ctx->enc_key));
+	ctx->data = ctx->cur = NULL;
+	ctx->rem = 0;
+}
 
 struct pex_update_request *
 pex_msg_update_request_init(const uint8_t *pubkey, const uint8_t *priv_key,
 			    const uint8_t *auth_key, union network_endpoint *addr,
-			    uint64_t cur_version, bool ext)
+			    uint64_t cur_version, size_t max_len, bool ext)
 {
 	struct pex_update_request *req;
 	struct pex_msg_update_recv_ctx *ctx;
@@ -426,8 +652,12 @@ pex_msg_update_request_init(const uint8_t *pubkey, const uint8_t *priv_key,
 
 	ctx = calloc(1, sizeof(*ctx));
 	memcpy(&ctx->addr, addr, sizeof(ctx->addr));
+	memcpy(ctx->pubkey, pubkey, sizeof(ctx->pubkey));
 	memcpy(ctx->auth_key, auth_key, sizeof(ctx->auth_key));
 	memcpy(ctx->priv_key, priv_key, sizeof(ctx->priv_key));
+	ctx->ext = ext;
+	ctx->max_len = max_len;
+	ctx->cur_version = cur_version;
 	randombytes(&ctx->req_id, sizeof(ctx->req_id));
 	list_add_tail(&ctx->list, &requests);
 	if (!gc_timer.pending)
@@ -463,37 +693,289 @@ pex_msg_update_recv_ctx_get(uint64_t req_id)
 static void pex_msg_update_ctx_free(struct pex_msg_update_recv_ctx *ctx)
 {
 	list_del(&ctx->list);
+	memset(ctx->enc_key, 0, sizeof(ctx->enc_key));
+	free(ctx->ranges);
 	free(ctx->data);
 	free(ctx);
 }
 
+/*
+ * returns 1 once the data has been received completely, -ENOSPC if the
+ * range would exceed the tracking limit
+ */
+static int
+pex_msg_update_range_add(struct pex_msg_update_recv_ctx *ctx,
+			 uint32_t start, uint32_t end)
+{
+	struct pex_msg_update_range *r = ctx->ranges;
+	int i, j;
+
+	for (i = 0; i < ctx->n_ranges; i++)
+		if (r[i].end >= start)
+			break;
+
+	if (i == ctx->n_ranges || r[i].start > end) {
+		if (ctx->n_ranges >= PEX_UPDATE_RANGES_MAX)
+			return -ENOSPC;
+
+		r = realloc(r, (ctx->n_ranges + 1) * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+
+		memmove(&r[i + 1], &r[i], (ctx->n_ranges - i) * sizeof(*r));
+		r[i].start = start;
+		r[i].end = end;
+		ctx->ranges = r;
+		ctx->n_ranges++;
+	} else {
+		if (start < r[i].start)
+			r[i].start = start;
+		if (end > r[i].end)
+			r[i].end = end;
+
+		for (j = i + 1; j < ctx->n_ranges && r[j].start <= r[i].end; j++)
+			if (r[j].end > r[i].end)
+				r[i].end = r[j].end;
+
+		memmove(&r[i + 1], &r[j], (ctx->n_ranges - j) * sizeof(*r));
+		ctx->n_ranges -= j - i - 1;
+	}
+
+	return ctx->n_ranges == 1 && !r[0].start && r[0].end == ctx->data_len;
+}
+
+static void
+pex_msg_update_resend_range_add(uint32_t start, uint32_t end)
+{
+	struct pex_update_resend_range *range;
+
+	range = pex_msg_append(sizeof(*range));
+	if (!range)
+		return;
+
+	range->offset = cpu_to_be32(start);
+	range->len = cpu_to_be32(end - start);
+}
+
+/*
+ * Ask for the missing parts of incomplete update responses, returns the
+ * number of requests that are still waiting for data.
+ */
+int pex_msg_update_request_resend(const uint8_t *auth_key,
+				  pex_msg_update_resend_cb_t cb, void *priv)
+{
+	struct pex_msg_update_recv_ctx *ctx;
+	struct pex_update_resend *res;
+	uint32_t prev;
+	int i, n = 0;
+
+	list_for_each_entry(ctx, &requests, list) {
+		if (memcmp(ctx->auth_key, auth_key, sizeof(ctx->auth_key)) != 0)
+			continue;
+
+		if (!ctx->partial || ctx->resend >= PEX_UPDATE_RESEND_MAX)
+			continue;
+
+		if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
+					PEX_MSG_UPDATE_RESEND, ctx->ext))
+			continue;
+
+		res = pex_msg_append(sizeof(*res));
+		res->req_id = ctx->req_id;
+
+		/* without the response header, everything needs to be sent again */
+		if (!ctx->data_len) {
+			pex_msg_update_resend_range_add(0, UINT32_MAX);
+		} else {
+			prev = 0;
+			for (i = 0; i < ctx->n_ranges && i < PEX_UPDATE_RESEND_RANGES_MAX - 1; i++) {
+				if (ctx->ranges[i].start > prev)
+					pex_msg_update_resend_range_add(prev, ctx->ranges[i].start);
+				prev = ctx->ranges[i].end;
+			}
+
+			if (prev < ctx->data_len)
+				pex_msg_update_resend_range_add(prev, ctx->data_len);
+		}
+
+		ctx->resend++;
+		cb(priv, &ctx->addr, ctx->ext);
+		n++;
+	}
+
+	return n;
+}
+
+static int
+pex_msg_update_recv_grow(struct pex_msg_update_recv_ctx *ctx, size_t len)
+{
+	size_t size = ctx->data_size;
+	void *data;
+
+	if (len <= size)
+		return 0;
+
+	/* grown on demand instead of trusting the announced length up front */
+	size *= 2;
+	if (size < len)
+		size = len;
+	if (size > (size_t)ctx->data_len)
+		size = ctx->data_len;
+
+	data = realloc(ctx->data, size);
+	if (!data)
+		return -1;
+
+	ctx->data = data;
+	ctx->data_size = size;
+
+	return 0;
+}
+
+/* feed the contiguous part of plain data received so far into the signature check */
+static int
+pex_msg_update_recv_verify(struct pex_msg_update_recv_ctx *ctx)
+{
+	uint32_t start = ctx->verified, end;
+
+	if (ctx->flags || !ctx->n_ranges || ctx->ranges[0].start)
+		return 0;
+
+	end = ctx->ranges[0].end;
+	if (end <= start || end < UNET_AUTH_HDR_LEN)
+		return 0;
+
+	if (!start) {
+		if (unet_auth_data_verify_init(&ctx->vst, ctx->auth_key,
+					       ctx->data, end))
+			return -1;
+
+		start = sizeof(struct unet_auth_hdr);
+	}
+
+	edsign_verify_add(&ctx->vst, ctx->data + start, end - start);
+	ctx->verified = end;
+
+	return 0;
+}
+
+/* repeat an update request with the cookie from the responder */
+struct pex_update_request *pex_msg_update_request_cookie(const void *data, size_t len)
+{
+	const struct pex_update_cookie *cookie = data;
+	struct pex_msg_update_recv_ctx *ctx;
+	struct pex_update_request *req;
+
+	if (len < sizeof(*cookie))
+		return NULL;
+
+	ctx = pex_msg_update_recv_ctx_get(cookie->req_id);
+	if (!ctx || ctx->data_len || ctx->cookie_replies++ >= PEX_UPDATE_COOKIE_MAX)
+		return NULL;
+
+	if (!__pex_msg_init_ext(ctx->pubkey, ctx->auth_key,
+				PEX_MSG_UPDATE_REQUEST, ctx->ext))
+		return NULL;
+
+	req = pex_msg_append(sizeof(*req));
+	req->req_id = ctx->req_id;
+	req->cur_version = cpu_to_be64(ctx->cur_version);
+	memcpy(req->cookie, cookie->cookie, sizeof(req->cookie));
+
+	return req;
+}
+
+/* takes over ctx->data */
+static void *
+pex_msg_update_decode(struct pex_msg_update_recv_ctx *ctx, const void *base,
+		      size_t base_len, size_t *len)
+{
+	void *data = ctx->data, *out;
+	size_t out_len;
+
+	ctx->data = NULL;
+	*len = ctx->data_len;
+
+	if (ctx->flags & PEX_UPDATE_F_COMPRESS) {
+		out = lz_decompress(data, *len, ctx->max_len, &out_len);
+		free(data);
+		if (!out)
+			return NULL;
+
+		data = out;
+		*len = out_len;
+	}
+
+	if (ctx->flags & PEX_UPDATE_F_DELTA) {
+		out = NULL;
+		if (base)
+			out = delta_apply(base, base_len, data, *len,
+					  ctx->max_len, &out_len);
+		free(data);
+		if (!out)
+			return NULL;
+
+		data = out;
+		*len = out_len;
+	}
+
+	return data;
+}
+
 void *pex_msg_update_response_recv(const void *data, int len, enum pex_opcode op,
-				   int *data_len, uint64_t *timestamp)
+				   int *data_len, uint64_t *timestamp,
+				   const void *base, size_t base_len)
 {
 	struct pex_msg_update_recv_ctx *ctx;
-	uint8_t enc_key[CURVE25519_KEY_SIZE];
+	size_t ret_len;
+	uint32_t ofs;
 	void *ret;
+	int done;
 
 	if (timestamp)
 		*timestamp = 0;
 	*data_len = 0;
-	if (op == PEX_MSG_UPDATE_RESPONSE) {
+	if (op == PEX_MSG_UPDATE_RESPONSE || op == PEX_MSG_UPDATE_RESPONSE_ENCODED) {
 		const struct pex_update_response *res = data;
+		size_t hdr_len = sizeof(*res);
+		uint32_t res_len, flags = 0;
 
-		if (len < sizeof(*res))
+		if (op == PEX_MSG_UPDATE_RESPONSE_ENCODED) {
+			const struct pex_update_response_encoded *enc = data;
+
+			hdr_len = sizeof(*enc);
+			if (len < hdr_len)
+				return NULL;
+
+			flags = be32_to_cpu(enc->flags);
+			if (flags & ~PEX_UPDATE_F_MASK)
+				return NULL;
+		}
+
+		if (len < hdr_len)
 			return NULL;
 
+		res_len = be32_to_cpu(res->data_len);
 		ctx = pex_msg_update_recv_ctx_get(res->req_id);
-		if (!ctx || ctx->data_len || !res->data_len ||
-		    be32_to_cpu(res->data_len) > UNETD_NET_DATA_SIZE_MAX)
+		if (!ctx || !res_len || res_len > ctx->max_len)
 			return NULL;
 
-		data += sizeof(*res);
-		len -= sizeof(*res);
-
-		ctx->data_len = be32_to_cpu(res->data_len);
-		memcpy(ctx->e_key, res->e_key, sizeof(ctx->e_key));
-		ctx->data = malloc(ctx->data_len);
+		data += hdr_len;
+		len -= hdr_len;
+
+		/* header may be sent again as part of a resend */
+		if (ctx->data_len) {
+			if (ctx->data_len != res_len || ctx->flags != flags ||
+			    memcmp(ctx->e_key, res->e_key, sizeof(ctx->e_key)) != 0)
+				return NULL;
+		} else {
+			ctx->data_len = res_len;
+			ctx->flags = flags;
+			memcpy(ctx->e_key, res->e_key, sizeof(ctx->e_key));
+			curve25519(ctx->enc_key, ctx->priv_key, ctx->e_key);
+		}
+		ctx->partial = true;
+		ofs = 0;
 	} else if (op == PEX_MSG_UPDATE_RESPONSE_DATA) {
 		const struct pex_update_response_data *res = data;
 
@@ -501,11 +983,17 @@ void *pex_msg_update_response_recv(const void *data, int len, enum pex_opcode op
 			return NULL;
 
 		ctx = pex_msg_update_recv_ctx_get(res->req_id);
-		if (!ctx || ctx->data_ofs != be32_to_cpu(res->offset))
+		if (!ctx)
+			return NULL;
+
+		/* chunks arriving ahead of the header are requested again later */
+		ctx->partial = true;
+		if (!ctx->data_len)
 			return NULL;
 
 		data += sizeof(*res);
 		len -= sizeof(*res);
+		ofs = be32_to_cpu(res->offset);
 	} else if (op == PEX_MSG_UPDATE_RESPONSE_NO_DATA ||
 	           op == PEX_MSG_UPDATE_RESPONSE_REFUSED) {
 		const struct pex_update_response_no_data *res = data;
@@ -524,22 +1012,58 @@ void *pex_msg_update_response_recv(const void *data, int len, enum pex_opcode op
 		return NULL;
 	}
 
-	if (ctx->data_ofs + len > ctx->data_len)
+	if (ofs > ctx->data_len || len > ctx->data_len - ofs)
 		goto error;
 
-	memcpy(ctx->data + ctx->data_ofs, data, len);
-	ctx->data_ofs += len;
-	if (ctx->data_ofs < ctx->data_len)
+	/* already validated data is never replaced */
+	if (ofs < ctx->verified) {
+		if (ofs + len <= ctx->verified)
+			return NULL;
+
+		data += ctx->verified - ofs;
+		len -= ctx->verified - ofs;
+		ofs = ctx->verified;
+	}
+
+	/* chunks that would need another disjoint range are requested again later */
+	done = pex_msg_update_range_add(ctx, ofs, ofs + len);
+	if (done == -ENOSPC)
 		return NULL;
 
-	curve25519(enc_key, ctx->priv_key, ctx->e_key);
-	chacha20_encrypt_msg(ctx->data, ctx->data_len, &ctx->req_id, enc_key);
-	if (unet_auth_data_validate(ctx->auth_key, ctx->data, ctx->data_len, timestamp, NULL))
+	if (done < 0 || pex_msg_update_recv_grow(ctx, ofs + len))
 		goto error;
 
-	*data_len = ctx->data_len;
-	ret = ctx->data;
-	ctx->data = NULL;
+	memcpy(ctx->data + ofs, data, len);
+	chacha20_encrypt_msg_at(ctx->data + ofs, len, &ctx->req_id, ctx->enc_key, ofs);
+
+	if (!done) {
+		if (pex_msg_update_recv_verify(ctx))
+			goto error;
+		return NULL;
+	}
+
+	if (!ctx->flags) {
+		if (pex_msg_update_recv_verify(ctx) ||
+		    unet_auth_data_verify_done(&ctx->vst, ctx->data, ctx->data_len,
+					       timestamp, NULL))
+			goto error;
+
+		ret = ctx->data;
+		ret_len = ctx->data_len;
+		ctx->data = NULL;
+	} else {
+		ret = pex_msg_update_decode(ctx, base, base_len, &ret_len);
+		if (!ret)
+			goto error;
+
+		/* the full signature is checked after decoding */
+		if (unet_auth_data_validate(ctx->auth_key, ret, ret_len, timestamp, NULL)) {
+			free(ret);
+			goto error;
+		}
+	}
+
+	*data_len = ret_len;
 	pex_msg_update_ctx_free(ctx);
 
 	return ret;
@@ -645,6 +1169,11 @@ int pex_open(void *addr, size_t addr_len, pex_recv_cb_t cb, bool server)
 
 	gc_timer.cb = pex_gc_cb;
 
+	if (server) {
+		pex_ekey_timer.cb = pex_ekey_pool_cb;
+		uloop_timeout_set(&pex_ekey_timer, PEX_EKEY_POOL_DELAY);
+	}
+
 	return 0;
 
 close_socket:
@@ -682,6 +1211,8 @@ int pex_unix_open(const char *path, pex_recv_control_cb_t cb)
 
 void pex_close(void)
 {
+	pex_msg_flush();
+
 	if (pex_raw_v4_fd >= 0)
 		close(pex_raw_v4_fd);
 	if (pex_raw_v6_fd >= 0)
@@ -701,4 +1232,9 @@ void pex_close(void)
 
 	pex_fd.cb = NULL;
 	pex_unix_fd.cb = NULL;
+
+	uloop_timeout_cancel(&pex_ekey_timer);
+	pex_ekey_timer.cb = NULL;
+	memset(pex_ekey_pool, 0, sizeof(pex_ekey_pool));
+	pex_ekey_pool_len = 0;
 }
@@ -1,6 +1,7 @@
 #ifndef __PEX_MSG_H
 #define __PEX_MSG_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,6 +13,7 @@
 #define PEX_BUF_SIZE			1024
 #define PEX_RX_BUF_SIZE			16384
 #define UNETD_NET_DATA_SIZE_MAX		(128 * 1024)
+#define UNETD_NET_DATA_SIZE_LIMIT	(16 * 1024 * 1024)
 
 enum pex_opcode {
 	PEX_MSG_HELLO,
@@ -27,6 +29,10 @@ enum pex_opcode {
 	PEX_MSG_ENDPOINT_PORT_NOTIFY,
 	PEX_MSG_ENROLL,
 	PEX_MSG_UPDATE_RESPONSE_REFUSED,
+	PEX_MSG_UPDATE_RESEND,
+	PEX_MSG_UPDATE_RESPONSE_ENCODED,
+	PEX_MSG_UPDATE_ANNOUNCE,
+	PEX_MSG_UPDATE_COOKIE,
 };
 
 #define PEX_ID_LEN		8
@@ -46,6 +52,9 @@ struct pex_ext_hdr {
 #define PEER_EP_F_IPV6		(1 << 0)
 #define PEER_EP_F_LOCAL		(1 << 1)
 
+/* hello only: sender handles PEX_MSG_UPDATE_ANNOUNCE */
+#define PEX_HELLO_F_ANNOUNCE	(1 << 2)
+
 struct pex_peer_endpoint {
 	uint16_t flags;
 	uint16_t port;
@@ -58,9 +67,32 @@ struct pex_hello {
 	uint8_t local_addr[16];
 };
 
+#define PEX_UPDATE_F_DELTA	(1 << 0)
+#define PEX_UPDATE_F_COMPRESS	(1 << 1)
+#define PEX_UPDATE_F_MASK	(PEX_UPDATE_F_DELTA | PEX_UPDATE_F_COMPRESS)
+
+#define PEX_COOKIE_LEN		8
+
 struct pex_update_request {
 	uint64_t req_id; /* must be first */
 	uint64_t cur_version;
+
+	/* not sent by older versions */
+	uint32_t flags;
+
+	/* echoed from PEX_MSG_UPDATE_COOKIE, zero otherwise */
+	uint8_t cookie[PEX_COOKIE_LEN];
+};
+
+#define PEX_UPDATE_REQUEST_MIN_LEN	offsetof(struct pex_update_request, flags)
+#define PEX_UPDATE_REQUEST_FLAGS_LEN	offsetof(struct pex_update_request, cookie)
+#define PEX_UPDATE_REQUEST_COOKIE_LEN \
+	(PEX_UPDATE_REQUEST_FLAGS_LEN + PEX_COOKIE_LEN)
+
+/* sent instead of a response under load, the request must be repeated with the cookie */
+struct pex_update_cookie {
+	uint64_t req_id; /* must be first */
+	uint8_t cookie[PEX_COOKIE_LEN];
 };
 
 struct pex_update_response {
@@ -69,16 +101,46 @@ struct pex_update_response {
 	uint8_t e_key[CURVE25519_KEY_SIZE];
 };
 
+/* data encoded as indicated by PEX_UPDATE_F_* flags */
+struct pex_update_response_encoded {
+	uint64_t req_id; /* must be first */
+	uint32_t data_len;
+	uint8_t e_key[CURVE25519_KEY_SIZE];
+	uint32_t flags;
+};
+
 struct pex_update_response_data {
 	uint64_t req_id; /* must be first */
 	uint32_t offset;
 };
 
+/* ranges per resend request, larger requests are truncated */
+#define PEX_UPDATE_RESEND_RANGES_MAX	64
+
+struct pex_update_resend {
+	uint64_t req_id; /* must be first */
+	/* followed by struct pex_update_resend_range[] */
+};
+
+struct pex_update_resend_range {
+	uint32_t offset;
+	uint32_t len;
+};
+
 struct pex_update_response_no_data {
 	uint64_t req_id; /* must be first */
 	uint64_t cur_version;
 };
 
+struct pex_update_announce {
+	uint64_t cur_version;
+};
+
+/* PEX_MSG_PING/PEX_MSG_PONG payload on the global port, echoed in the reply */
+struct pex_endpoint_probe {
+	uint64_t id;
+};
+
 struct pex_endpoint_port_notify {
 	uint16_t port;
 };
@@ -89,8 +151,16 @@ struct pex_msg_update_send_ctx {
 	uint64_t req_id;
 	bool ext;
 
-	void *data;
-	void *cur;
+	/* PEX_UPDATE_F_* encoding of the data, set before init */
+	uint32_t flags;
+
+	uint8_t e_key[CURVE25519_KEY_SIZE];
+	uint8_t enc_key[CURVE25519_KEY_SIZE];
+
+	/* not copied, must stay valid until pex_msg_update_response_free */
+	const void *data;
+	const void *cur;
+	int len;
 	int rem;
 };
 
@@ -117,15 +187,23 @@ struct pex_hdr *__pex_msg_init(const uint8_t *pubkey, uint8_t opcode);
 struct pex_hdr *__pex_msg_init_ext(const uint8_t *pubkey, const uint8_t *auth_key,
 				   uint8_t opcode, bool ext);
 int __pex_msg_send(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen);
+void pex_msg_flush(void);
 void *pex_msg_append(size_t len);
 void *pex_msg_tail(void);
 
 struct pex_update_request *
 pex_msg_update_request_init(const uint8_t *pubkey, const uint8_t *priv_key,
 			    const uint8_t *auth_key, union network_endpoint *addr,
-			    uint64_t cur_version, bool ext);
+			    uint64_t cur_version, size_t max_len, bool ext);
 void *pex_msg_update_response_recv(const void *data, int len, enum pex_opcode op,
-				   int *data_len, uint64_t *timestamp);
+				   int *data_len, uint64_t *timestamp,
+				   const void *base, size_t base_len);
+
+typedef void (*pex_msg_update_resend_cb_t)(void *priv, union network_endpoint *addr,
+					   bool ext);
+int pex_msg_update_request_resend(const uint8_t *auth_key,
+				  pex_msg_update_resend_cb_t cb, void *priv);
+struct pex_update_request *pex_msg_update_request_cookie(const void *data, size_t len);
 
 void pex_msg_update_response_init(struct pex_msg_update_send_ctx *ctx,
 				  const uint8_t *pubkey, const uint8_t *auth_key,
@@ -133,5 +211,8 @@ void pex_msg_update_response_init(struct pex_msg_update_send_ctx *ctx,
 				  struct pex_update_request *req,
 				  const void *data, int len);
 bool pex_msg_update_response_continue(struct pex_msg_update_send_ctx *ctx);
+void pex_msg_update_response_seek(struct pex_msg_update_send_ctx *ctx,
+				  uint32_t offset, uint32_t len);
+void pex_msg_update_response_free(struct pex_msg_update_send_ctx *ctx);
 
 #endif
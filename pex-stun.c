@@ -4,6 +4,7 @@
 #include <netinet/udp.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <libubox/usock.h>
 
@@ -34,9 +35,23 @@ void network_stun_server_add(struct network *net, const char *host)
 	struct network_stun *stun = &net->stun;
 	struct network_stun_server *s;
 	char *name_buf;
+	int i;
 
+	list_for_each_entry(s, &stun->old_servers, list) {
+		if (strcmp(s->host, host) != 0)
+			continue;
+
+		list_move_tail(&s->list, &stun->servers);
+		return;
+	}
+
+	stun->servers_changed = true;
 	s = calloc_a(sizeof(*s), &name_buf, strlen(host) + 1);
-	s->pending_node.key = s->req.transaction;
+	for (i = 0; i < ARRAY_SIZE(s->query); i++) {
+		s->query[i].pending_node.key = s->query[i].req.transaction;
+		s->query[i].s = s;
+		s->query[i].auth = i;
+	}
 	s->host = strcpy(name_buf, host);
 
 	list_add_tail(&s->list, &stun->servers);
@@ -63,27 +78,26 @@ network_stun_socket_cb(struct uloop_fd *fd, unsigned int events)
 {
 	struct network_stun *stun = container_of(fd, struct network_stun, socket);
 	struct network *net = container_of(stun, struct network, stun);
-	char buf[1024];
-	ssize_t len;
-
-	while (1) {
-		len = recv(fd->fd, buf, sizeof(buf), 0);
-		if (len < 0) {
-			if (errno == EAGAIN)
-				break;
-			if (errno == EINTR)
-				continue;
-
-			perror("recv");
+	static char buf[UDP_RX_BATCH][1024];
+	size_t len[UDP_RX_BATCH];
+	int i, n;
+
+	do {
+		n = udp_recv_batch(fd->fd, buf, sizeof(buf[0]), len, NULL, UDP_RX_BATCH);
+		if (n < 0) {
+			perror("recvmmsg");
 			network_stun_close_socket(net);
 			return;
 		}
 
-		if (!stun_msg_is_valid(buf, len))
-			continue;
+		/* the socket is closed once all results are in */
+		for (i = 0; i < n && stun->wgport_disabled; i++) {
+			if (!stun_msg_is_valid(buf[i], len[i]))
+				continue;
 
-		network_stun_rx_packet(net, buf, len);
-	}
+			network_stun_rx_packet(net, buf[i], len[i]);
+		}
+	} while (n == UDP_RX_BATCH && stun->wgport_disabled);
 }
 
 static void
@@ -111,84 +125,103 @@ network_stun_open_socket(struct network *net)
 	stun->wgport_disabled = true;
 }
 
-static bool
-network_stun_query_next(struct network *net)
+static void
+network_stun_query_send(struct network *net, struct network_stun_query *q,
+			union network_endpoint *ep)
 {
 	struct network_stun *stun = &net->stun;
-	struct network_stun_server *s;
 	char addrstr[INET6_ADDRSTRLEN];
-	union network_endpoint ep;
 	uint16_t res_port = 0;
 	const void *msg;
 	ssize_t ret;
 	size_t len;
 
-	s = list_first_entry(&stun->servers, struct network_stun_server, list);
-	if (s->pending)
-		return false;
-
-	/* send next query */
-	if (network_get_endpoint(&ep, AF_INET, s->host, 0, s->seq++) < 0) {
-		D_NET(net, "lookup failed for STUN host %s", s->host);
-		goto out;
-	}
-
-	if (ep.sa.sa_family != AF_INET || !ep.in.sin_port)
-		goto out;
-
-	if (!stun->wgport_disabled && stun->auth_port_ext)
+	if (!q->auth && !stun->wgport_disabled)
 		res_port = stun->auth_port_ext;
 
-	D_NET(net, "Send STUN query to %s, res_port=%d, wg_disabled=%d",
-	      inet_ntop(ep.sa.sa_family, network_endpoint_addr(&ep, NULL),
+	D_NET(net, "Send STUN %s query to %s, res_port=%d, wg_disabled=%d",
+	      q->auth ? "auth" : "data",
+	      inet_ntop(ep->sa.sa_family, network_endpoint_addr(ep, NULL),
 			addrstr, sizeof(addrstr)), res_port, stun->wgport_disabled);
-	msg = stun_msg_request_prepare(&s->req, &len, res_port);
+	msg = stun_msg_request_prepare(&q->req, &len, res_port);
 	if (!msg)
-		goto out;
+		return;
+
+	avl_insert(&stun->pending, &q->pending_node);
+	q->pending = true;
+	q->sent = unet_gettime_ms();
 
 retry:
-	s->req_auth_port = false;
-	if (stun->wgport_disabled) {
-		ret = sendto(stun->socket.fd, msg, len, 0, &ep.sa, sizeof(ep.in));
-	} else if (!stun->auth_port_ext) {
-		s->req_auth_port = true;
-		ret = sendto(pex_socket(), msg, len, 0, &ep.sa, sizeof(ep.in));
+	if (q->auth) {
+		ret = sendto(pex_socket(), msg, len, 0, &ep->sa, sizeof(ep->in));
+	} else if (stun->wgport_disabled) {
+		ret = sendto(stun->socket.fd, msg, len, 0, &ep->sa, sizeof(ep->in));
 	} else {
+		union network_endpoint dest = *ep;
 		struct {
 		    struct ip ip;
 		    struct udphdr udp;
 		} packet_hdr = {};
 		union network_addr local_addr = {};
 
-		network_get_local_addr(&local_addr, &ep);
+		network_get_local_addr(&local_addr, ep);
 		packet_hdr.ip = (struct ip){
 			.ip_hl = 5,
 			.ip_v = 4,
 			.ip_ttl = 64,
 			.ip_p = IPPROTO_UDP,
 			.ip_src = local_addr.in,
-			.ip_dst = ep.in.sin_addr,
+			.ip_dst = ep->in.sin_addr,
 		};
 		packet_hdr.udp = (struct udphdr){
 			.uh_sport = htons(stun->port_local),
-			.uh_dport = ep.in.sin_port,
+			.uh_dport = ep->in.sin_port,
 		};
-		ep.in.sin_port = 0;
+		dest.in.sin_port = 0;
 
-		ret = sendto_rawudp(pex_raw_socket(AF_INET), &ep,
+		ret = sendto_rawudp(pex_raw_socket(AF_INET), &dest,
 				    &packet_hdr, sizeof(packet_hdr),
 				    msg, len);
 	}
 
 	if (ret < 0 && errno == EINTR)
 		goto retry;
+}
 
-out:
-	avl_insert(&stun->pending, &s->pending_node);
-	s->pending = true;
+/* query all servers at once, returns false if there is nothing to ask for */
+static bool
+network_stun_query_all(struct network *net)
+{
+	struct network_stun *stun = &net->stun;
+	struct network_stun_server *s;
+	union network_endpoint ep;
+	bool query_auth, query_data;
+
+	/*
+	 * the data port can be queried through the STUN socket, or from the
+	 * auth port with the response sent to it. The auth port is needed first
+	 * in the latter case.
+	 */
+	query_auth = !stun->auth_port_ext;
+	query_data = stun->wgport_disabled || stun->auth_port_ext;
+	if (!query_auth && !query_data)
+		return false;
 
-	if (!list_is_last(&s->list, &stun->servers))
-		list_move_tail(&s->list, &stun->servers);
+	list_for_each_entry(s, &stun->servers, list) {
+		s->port[false] = s->port[true] = 0;
+		if (network_get_endpoint(&ep, AF_INET, s->host, 0, s->seq++) < 0) {
+			D_NET(net, "lookup failed for STUN host %s", s->host);
+			continue;
+		}
+
+		if (ep.sa.sa_family != AF_INET || !ep.in.sin_port)
+			continue;
+
+		if (query_auth)
+			network_stun_query_send(net, &s->query[true], &ep);
+		if (query_data)
+			network_stun_query_send(net, &s->query[false], &ep);
+	}
 
 	return true;
 }
@@ -197,42 +230,114 @@ static void
 network_stun_query_clear_pending(struct network *net)
 {
 	struct network_stun *stun = &net->stun;
+	struct network_stun_query *q, *tmp;
+
+	avl_remove_all_elements(&stun->pending, q, pending_node, tmp)
+		q->pending = false;
+}
+
+static void
+network_stun_server_update_rtt(struct network *net, struct network_stun_server *s,
+			       unsigned int rtt)
+{
+	struct network_stun *stun = &net->stun;
+	struct network_stun_server *cur;
+
+	s->rtt = s->rtt ? (s->rtt * 3 + rtt) / 4 : rtt;
+
+	/* keep the fastest servers first */
+	list_del(&s->list);
+	list_for_each_entry(cur, &stun->servers, list) {
+		if (!cur->rtt || cur->rtt > s->rtt)
+			break;
+	}
+	list_add_tail(&s->list, &cur->list);
+}
+
+/* returns true if the state machine moved on */
+static bool
+network_stun_result(struct network *net, bool auth, uint16_t port)
+{
+	struct network_stun *stun = &net->stun;
+
+	network_stun_update_port(net, auth, port);
+	if (!auth)
+		stun->state = STUN_STATE_IDLE;
+	else if (!stun->wgport_disabled)
+		stun->state = STUN_STATE_STUN_QUERY_SEND;
+	else
+		return false;
+
+	network_stun_query_clear_pending(net);
+	uloop_timeout_set(&stun->timer, 1);
+
+	return true;
+}
+
+/* a result is accepted once two servers agree, or if there is only one server */
+static bool
+network_stun_consensus(struct network *net, bool auth, uint16_t port)
+{
 	struct network_stun_server *s;
+	int total = 0, match = 0;
 
-	list_for_each_entry(s, &stun->servers, list) {
-		if (!s->pending)
-			continue;
+	list_for_each_entry(s, &net->stun.servers, list) {
+		total++;
+		if (s->port[auth] == port)
+			match++;
+	}
 
-		avl_delete(&stun->pending, &s->pending_node);
-		s->pending = false;
+	return match >= 2 || total == 1;
+}
+
+/* fallback on timeout: use the result from the fastest server that replied */
+static bool
+network_stun_accept_any(struct network *net)
+{
+	struct network_stun_server *s;
+	int auth;
+
+	for (auth = 0; auth < 2; auth++) {
+		list_for_each_entry(s, &net->stun.servers, list) {
+			if (!s->port[auth])
+				continue;
+
+			D_NET(net, "no STUN consensus, using %s", s->host);
+			if (network_stun_result(net, auth, s->port[auth]))
+				return true;
+			break;
+		}
 	}
+
+	return false;
 }
 
 void network_stun_rx_packet(struct network *net, const void *data, size_t len)
 {
 	struct network_stun *stun = &net->stun;
 	const struct stun_msg_hdr *hdr = data;
+	struct network_stun_query *q;
 	struct network_stun_server *s;
 
-	s = avl_find_element(&stun->pending, hdr->transaction, s, pending_node);
-	if (!s)
+	q = avl_find_element(&stun->pending, hdr->transaction, q, pending_node);
+	if (!q)
 		return;
 
-	if (!stun_msg_request_complete(&s->req, data, len))
+	if (!stun_msg_request_complete(&q->req, data, len))
 		return;
 
-	if (!s->req.port)
-		return;
+	avl_delete(&stun->pending, &q->pending_node);
+	q->pending = false;
 
-	network_stun_update_port(net, s->req_auth_port, s->req.port);
-	if (s->req_auth_port)
-		stun->state = STUN_STATE_STUN_QUERY_SEND;
-	else
-		stun->state = STUN_STATE_IDLE;
+	if (!q->req.port)
+		return;
 
-	network_stun_query_clear_pending(net);
+	s = q->s;
+	network_stun_server_update_rtt(net, s, unet_gettime_ms() - q->sent);
+	s->port[q->auth] = q->req.port;
 
-	uloop_timeout_set(&stun->timer, 1);
+	if (network_stun_consensus(net, q->auth, q->req.port))
+		network_stun_result(net, q->auth, q->req.port);
 }
 
 static void
@@ -254,9 +359,10 @@ restart:
 		stun->state = STUN_STATE_STUN_QUERY_SEND;
 		fallthrough;
 	case STUN_STATE_STUN_QUERY_SEND:
-		if (network_stun_query_next(net)) {
-			next = 50;
-			break;
+		network_stun_query_clear_pending(net);
+		if (!network_stun_query_all(net)) {
+			stun->state = STUN_STATE_IDLE;
+			goto restart;
 		}
 
 		stun->state = STUN_STATE_STUN_QUERY_WAIT;
@@ -264,6 +370,9 @@ restart:
 		next = 1000;
 		break;
 	case STUN_STATE_STUN_QUERY_WAIT:
+		if (network_stun_accept_any(net))
+			return;
+
 		D_NET(net, "timeout waiting for STUN server responses, retry=%d", stun->retry);
 		network_stun_query_clear_pending(net);
 		if (stun->retry > 0) {
@@ -301,14 +410,26 @@ void network_stun_start(struct network *net)
 	struct network_stun *stun = &net->stun;
 	unsigned int next = 1;
 
-	if (!local || list_empty(&stun->servers))
+	if (!local || list_empty(&stun->servers)) {
+		uloop_timeout_cancel(&stun->timer);
+		network_stun_query_clear_pending(net);
 		return;
+	}
 
 	if (local->peer.port != stun->port_local) {
 		stun->port_ext = 0;
 		stun->port_local = local->peer.port;
+		stun->servers_changed = true;
+	}
+
+	/* nothing relevant changed, keep the current discovery state */
+	if (!stun->servers_changed && stun->timer.pending) {
+		D_NET(net, "keep STUN state");
+		return;
 	}
 
+	network_stun_query_clear_pending(net);
+
 	if (!stun->port_ext && has_connected_peer(net, true)) {
 		D_NET(net, "wait for port information from PEX");
 		stun->state = STUN_STATE_PEX_QUERY_WAIT;
@@ -331,9 +452,53 @@ void network_stun_init(struct network *net)
 	stun->socket.cb = network_stun_socket_cb;
 	stun->timer.cb = network_stun_timer_cb;
 	INIT_LIST_HEAD(&stun->servers);
+	INIT_LIST_HEAD(&stun->old_servers);
 	avl_init(&stun->pending, avl_stun_cmp, true, NULL);
 }
 
+static void
+network_stun_server_free(struct network *net, struct network_stun_server *s)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s->query); i++) {
+		if (!s->query[i].pending)
+			continue;
+
+		avl_delete(&net->stun.pending, &s->query[i].pending_node);
+		s->query[i].pending = false;
+	}
+
+	list_del(&s->list);
+	free(s);
+}
+
+void network_stun_update_start(struct network *net)
+{
+	struct network_stun *stun = &net->stun;
+
+	/* the wireguard port is reconfigured on reload */
+	if (stun->wgport_disabled) {
+		uloop_timeout_cancel(&stun->timer);
+		network_stun_query_clear_pending(net);
+		network_stun_close_socket(net);
+	}
+
+	list_splice_init(&stun->servers, &stun->old_servers);
+	stun->servers_changed = false;
+}
+
+void network_stun_update_done(struct network *net)
+{
+	struct network_stun *stun = &net->stun;
+	struct network_stun_server *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &stun->old_servers, list) {
+		network_stun_server_free(net, s);
+		stun->servers_changed = true;
+	}
+}
+
 void network_stun_free(struct network *net)
 {
 	struct network_stun *stun = &net->stun;
@@ -341,12 +506,9 @@ void network_stun_free(struct network *net)
 
 	uloop_timeout_cancel(&stun->timer);
 	network_stun_close_socket(net);
+	network_stun_query_clear_pending(net);
 
-	avl_remove_all_elements(&stun->pending, s, pending_node, tmp)
-		s->pending = false;
-
-	list_for_each_entry_safe(s, tmp, &stun->servers, list) {
-		list_del(&s->list);
-		free(s);
-	}
+	list_splice_init(&stun->old_servers, &stun->servers);
+	list_for_each_entry_safe(s, tmp, &stun->servers, list)
+		network_stun_server_free(net, s);
 }
@@ -14,7 +14,117 @@
 #include <inttypes.h>
 #include "unetd.h"
 #include "pex-msg.h"
+#include "random.h"
 #include "enroll.h"
+#include "delta.h"
+#include "lz.h"
+
+#define NETWORK_PEX_UPDATES_MAX		16
+#define NETWORK_PEX_UPDATE_RESEND_MAX	5
+
+/* ms */
+#define NETWORK_PEX_UPDATE_TIMEOUT	5000
+#define NETWORK_PEX_RESEND_DELAY	300
+#define NETWORK_PEX_RESEND_INTERVAL	1000
+#define NETWORK_PEX_TX_TICK		10
+
+/* update response datagrams per tick, shared by all transfers */
+#define NETWORK_PEX_TX_BUDGET		32
+
+/* update response datagrams per tick for a single transfer */
+#define NETWORK_PEX_RATE_INIT		4
+#define NETWORK_PEX_RATE_MAX		16
+
+/* new versions are announced to a few random peers per round */
+#define NETWORK_PEX_GOSSIP_FANOUT	3
+#define NETWORK_PEX_GOSSIP_ROUNDS	4
+#define NETWORK_PEX_GOSSIP_INTERVAL	1000
+
+/* s */
+#define NETWORK_PEX_UPDATE_PENDING_TIMEOUT	10
+
+/* ms, endpoint changes within this window are sent together */
+#define NETWORK_PEX_ENDPOINT_NOTIFY_DELAY	100
+
+#define GLOBAL_PEX_NET_HASH_BITS	6
+
+/*
+ * Update requests from outside the tunnel: above this many per second,
+ * a cookie bound to the source address must be echoed before a response
+ * is sent. Cookie mode stays on for a while after the load drops.
+ */
+#define GLOBAL_PEX_COOKIE_THRESHOLD	8
+#define GLOBAL_PEX_COOKIE_HOLD		10
+#define GLOBAL_PEX_COOKIE_ROTATE	120
+
+/* per-source token bucket for update requests from outside the tunnel */
+#define GLOBAL_PEX_SRC_BUCKETS		256
+#define GLOBAL_PEX_SRC_RATE		2
+#define GLOBAL_PEX_SRC_BURST		8
+
+#define NETWORK_PEX_NOTIFY_PEERS_MAX \
+	((PEX_BUF_SIZE - sizeof(struct pex_hdr)) / sizeof(struct pex_peer_endpoint))
+
+struct network_pex_update {
+	struct list_head list;
+	struct list_head tx_list;
+	struct uloop_timeout timeout;
+	struct network *net;
+
+	struct sockaddr_in6 addr;
+	int resend;
+	int rate;
+
+	/* started by a request from outside the tunnel with a valid cookie */
+	bool cookie;
+
+	/* ranges requested by the receiver, sent after the current one */
+	struct pex_update_resend_range *ranges;
+	int n_ranges, cur_range;
+
+	struct pex_msg_update_send_ctx ctx;
+};
+
+static LIST_HEAD(update_tx_list);
+static struct network *global_pex_net_hash[1 << GLOBAL_PEX_NET_HASH_BITS];
+
+static unsigned int
+global_pex_net_hash_idx(const uint8_t *id)
+{
+	uint64_t val;
+
+	memcpy(&val, id, sizeof(val));
+
+	return (val * 0x9e3779b97f4a7c15ULL) >> (64 - GLOBAL_PEX_NET_HASH_BITS);
+}
+
+static void
+global_pex_net_hash_add(struct network *net)
+{
+	unsigned int idx = global_pex_net_hash_idx(net->config.auth_key);
+
+	if (net->pex.hashed)
+		return;
+
+	net->pex.hash_next = global_pex_net_hash[idx];
+	global_pex_net_hash[idx] = net;
+	net->pex.hashed = true;
+}
+
+static void
+global_pex_net_hash_del(struct network *net)
+{
+	struct network **cur;
+
+	if (!net->pex.hashed)
+		return;
+
+	cur = &global_pex_net_hash[global_pex_net_hash_idx(net->config.auth_key)];
+	while (*cur != net)
+		cur = &(*cur)->pex.hash_next;
+	*cur = net->pex.hash_next;
+	net->pex.hashed = false;
+}
 
 static const char *pex_peer_id_str(const uint8_t *key)
 {
@@ -43,11 +153,9 @@ static struct network_peer *
 pex_msg_peer(struct network *net, const uint8_t *id, bool allow_indirect)
 {
 	struct network_peer *peer;
-	uint8_t key[WG_KEY_LEN] = {};
 
-	memcpy(key, id, PEX_ID_LEN);
-	peer = avl_find_ge_element(&net->peers.avl, key, peer, node.avl);
-	if (!peer || memcmp(peer->key, key, PEX_ID_LEN) != 0) {
+	peer = network_peer_find(net, id, PEX_ID_LEN);
+	if (!peer) {
 		D_NET(net, "can't find peer %s", pex_peer_id_str(id));
 		return NULL;
 	}
@@ -103,6 +211,7 @@ pex_send_hello(struct network *net, struct network_peer *peer)
 
 	pex_msg_init(net, PEX_MSG_HELLO);
 	data = pex_msg_append(sizeof(*data));
+	data->flags = htons(PEX_HELLO_F_ANNOUNCE);
 	if (peer->state.endpoint.sa.sa_family == AF_INET6)
 	    data->flags |= htons(PEER_EP_F_IPV6);
 	if (network_get_local_addr(&data->local_addr, &peer->state.endpoint))
@@ -152,20 +261,48 @@ pex_msg_add_peer_endpoint(struct network *net, struct network_peer *peer,
 }
 
 static void
-network_pex_handle_endpoint_change(struct network *net, struct network_peer *peer)
+network_pex_endpoint_notify_cb(struct uloop_timeout *t)
 {
-	struct network_peer *cur;
+	struct network *net = container_of(t, struct network, pex.endpoint_notify_timer);
+	struct network_peer *cur, *peer;
+	int n;
 
+	/* one message per receiver, carrying all changed peers that fit */
 	vlist_for_each_element(&net->peers, cur, node) {
-		if (cur == peer || !cur->state.connected || cur->indirect)
+		if (!cur->state.connected || cur->indirect)
 			continue;
 
+		n = 0;
 		pex_msg_init(net, PEX_MSG_NOTIFY_PEERS);
-		if (pex_msg_add_peer_endpoint(net, peer, cur))
-			continue;
+		vlist_for_each_element(&net->peers, peer, node) {
+			if (peer == cur || !peer->state.endpoint_changed)
+				continue;
 
-		pex_msg_send(net, cur);
+			if (n == NETWORK_PEX_NOTIFY_PEERS_MAX) {
+				pex_msg_send(net, cur);
+				pex_msg_init(net, PEX_MSG_NOTIFY_PEERS);
+				n = 0;
+			}
+
+			if (!pex_msg_add_peer_endpoint(net, peer, cur))
+				n++;
+		}
+
+		if (n)
+			pex_msg_send(net, cur);
 	}
+
+	vlist_for_each_element(&net->peers, peer, node)
+		peer->state.endpoint_changed = false;
+}
+
+static void
+network_pex_handle_endpoint_change(struct network *net, struct network_peer *peer)
+{
+	peer->state.endpoint_changed = true;
+	if (!net->pex.endpoint_notify_timer.pending)
+		uloop_timeout_set(&net->pex.endpoint_notify_timer,
+				  NETWORK_PEX_ENDPOINT_NOTIFY_DELAY);
 }
 
 static void
@@ -250,9 +387,66 @@ network_pex_host_send_port_notify(struct network *net, struct network_pex_host *
 	__pex_msg_send(-1, &host->endpoint, NULL, 0);
 }
 
+static uint32_t
+network_pex_update_request_flags(struct network *net)
+{
+	uint32_t flags = PEX_UPDATE_F_COMPRESS;
+
+	if (net->net_data_len)
+		flags |= PEX_UPDATE_F_DELTA;
+
+	return flags;
+}
+
+/* returns the subset of the requested encodings that is actually used */
+static uint32_t
+network_pex_update_encode(struct network *net, uint64_t req_version, uint32_t flags,
+			  const void **data, size_t *len)
+{
+	uint32_t used = 0;
+
+	*data = net->net_data;
+	*len = net->net_data_len;
+
+	/* encoded copies are cached until the network data changes */
+	if ((flags & PEX_UPDATE_F_DELTA) && net->net_data_prev &&
+	    req_version == net->net_data_prev_version) {
+		struct network_data_enc *enc = &net->net_data_enc[PEX_UPDATE_F_DELTA];
+
+		if (!enc->data)
+			enc->data = delta_encode(net->net_data_prev,
+						 net->net_data_prev_len,
+						 net->net_data, net->net_data_len,
+						 &enc->len);
+
+		if (enc->data && enc->len < *len) {
+			used |= PEX_UPDATE_F_DELTA;
+			*data = enc->data;
+			*len = enc->len;
+		}
+	}
+
+	if (flags & PEX_UPDATE_F_COMPRESS) {
+		struct network_data_enc *enc;
+
+		enc = &net->net_data_enc[used | PEX_UPDATE_F_COMPRESS];
+		if (!enc->data)
+			enc->data = lz_compress(*data, *len, &enc->len);
+
+		if (enc->data && enc->len < *len) {
+			used |= PEX_UPDATE_F_COMPRESS;
+			*data = enc->data;
+			*len = enc->len;
+		}
+	}
+
+	return used;
+}
+
 static void
 network_pex_host_request_update(struct network *net, struct network_pex_host *host)
 {
+	struct pex_update_request *req;
 	char addrstr[INET6_ADDRSTRLEN];
 	uint64_t version = 0;
 
@@ -268,11 +462,14 @@ network_pex_host_request_update(struct network *net, struct network_pex_host *ho
 		     (const void *)&host->endpoint.in.sin_addr),
 		    addrstr, sizeof(addrstr)));
 
-	if (!pex_msg_update_request_init(net->config.pubkey, net->config.key,
-					 net->config.auth_key, &host->endpoint,
-					 version, true))
+	req = pex_msg_update_request_init(net->config.pubkey, net->config.key,
+					  net->config.auth_key, &host->endpoint,
+					  version, net->config.data_size_max, true);
+	if (!req)
 		return;
 
+	req->flags = cpu_to_be32(network_pex_update_request_flags(net));
+
 	__pex_msg_send(-1, &host->endpoint, NULL, 0);
 
 	if (!net->net_config.local_host)
@@ -282,10 +479,42 @@ network_pex_host_request_update(struct network *net, struct network_pex_host *ho
 	network_pex_host_send_endpoint_notify(net, host);
 }
 
+static unsigned int
+network_pex_host_hash(const union network_endpoint *ep)
+{
+	const uint8_t *data = (const uint8_t *)ep;
+	uint32_t hash = 2166136261;
+	size_t i;
+
+	for (i = 0; i < sizeof(*ep); i++)
+		hash = (hash ^ data[i]) * 16777619;
+
+	return hash % NETWORK_PEX_HOST_HASH_SIZE;
+}
+
+static struct network_pex_host *
+network_pex_host_find(struct network_pex *pex, const union network_endpoint *ep)
+{
+	struct network_pex_host *host;
+
+	host = pex->host_hash[network_pex_host_hash(ep)];
+	for (; host; host = host->hash_next)
+		if (!memcmp(&host->endpoint, ep, sizeof(*ep)))
+			return host;
+
+	return NULL;
+}
+
 static void
 network_pex_free_host(struct network *net, struct network_pex_host *host)
 {
 	struct network_pex *pex = &net->pex;
+	struct network_pex_host **cur;
+
+	cur = &pex->host_hash[network_pex_host_hash(&host->endpoint)];
+	while (*cur != host)
+		cur = &(*cur)->hash_next;
+	*cur = host->hash_next;
 
 	pex->num_hosts--;
 	list_del(&host->list);
@@ -319,6 +548,222 @@ network_pex_request_update_cb(struct uloop_timeout *t)
 	}
 }
 
+static void
+network_pex_update_free(struct network *net, struct network_pex_update *upd)
+{
+	uloop_timeout_cancel(&upd->timeout);
+	list_del(&upd->list);
+	list_del(&upd->tx_list);
+	net->pex.num_updates--;
+	pex_msg_update_response_free(&upd->ctx);
+	free(upd->ranges);
+	free(upd);
+}
+
+static void
+network_pex_update_timeout_cb(struct uloop_timeout *t)
+{
+	struct network_pex_update *upd = container_of(t, struct network_pex_update, timeout);
+
+	network_pex_update_free(upd->net, upd);
+}
+
+void network_pex_updates_free(struct network *net)
+{
+	struct network_pex_update *upd, *tmp;
+
+	list_for_each_entry_safe(upd, tmp, &net->pex.updates, list)
+		network_pex_update_free(net, upd);
+}
+
+static struct network_pex_update *
+network_pex_update_alloc(struct network *net, struct network_peer *peer,
+			 struct sockaddr_in6 *addr)
+{
+	struct network_pex *pex = &net->pex;
+	struct network_pex_update *upd;
+
+	/*
+	 * Make room by dropping the oldest transfer that has been sent completely
+	 * and only waits for resend requests. Transfers still being sent are
+	 * never aborted, the request is refused and will be retried instead.
+	 */
+	if (pex->num_updates >= NETWORK_PEX_UPDATES_MAX) {
+		list_for_each_entry(upd, &pex->updates, list)
+			if (list_empty(&upd->tx_list))
+				goto evict;
+
+		return NULL;
+
+evict:
+		network_pex_update_free(net, upd);
+	}
+
+	upd = calloc(1, sizeof(*upd));
+	upd->net = net;
+	if (addr)
+		upd->addr = *addr;
+	else
+		pex_get_peer_addr(&upd->addr, net, peer);
+
+	upd->rate = NETWORK_PEX_RATE_INIT;
+	upd->timeout.cb = network_pex_update_timeout_cb;
+	INIT_LIST_HEAD(&upd->tx_list);
+	list_add_tail(&upd->list, &pex->updates);
+	pex->num_updates++;
+
+	return upd;
+}
+
+static void
+network_pex_update_send(struct network *net, struct network_pex_update *upd)
+{
+	int fd = upd->ctx.ext ? -1 : net->pex.fd.fd;
+
+	if (__pex_msg_send(fd, &upd->addr, NULL, 0) < 0)
+		D_NET(net, "pex update send failed: %s", strerror(errno));
+}
+
+static bool
+network_pex_update_next(struct network_pex_update *upd)
+{
+	struct pex_update_resend_range *range;
+
+	while (!pex_msg_update_response_continue(&upd->ctx)) {
+		if (upd->cur_range >= upd->n_ranges)
+			return false;
+
+		range = &upd->ranges[upd->cur_range++];
+		pex_msg_update_response_seek(&upd->ctx, range->offset, range->len);
+	}
+
+	return true;
+}
+
+static void
+network_pex_update_tx_cb(struct uloop_timeout *t)
+{
+	struct network_pex_update *upd, *tmp;
+	int budget = NETWORK_PEX_TX_BUDGET;
+	int i;
+
+	list_for_each_entry_safe(upd, tmp, &update_tx_list, tx_list) {
+		for (i = 0; i < upd->rate && budget > 0; i++, budget--) {
+			if (!network_pex_update_next(upd)) {
+				list_del_init(&upd->tx_list);
+				uloop_timeout_set(&upd->timeout, NETWORK_PEX_UPDATE_TIMEOUT);
+				break;
+			}
+
+			network_pex_update_send(upd->net, upd);
+		}
+
+		/* no loss reported for this transfer yet, speed up */
+		if (i == upd->rate && !upd->resend && upd->rate < NETWORK_PEX_RATE_MAX)
+			upd->rate++;
+
+		if (!budget)
+			break;
+	}
+
+	if (list_empty(&update_tx_list))
+		return;
+
+	/* rotate, so that transfers share the budget fairly */
+	list_move_tail(update_tx_list.next, &update_tx_list);
+	uloop_timeout_set(t, NETWORK_PEX_TX_TICK);
+}
+
+static struct uloop_timeout update_tx_timer = {
+	.cb = network_pex_update_tx_cb,
+};
+
+static void
+network_pex_update_start(struct network_pex_update *upd)
+{
+	uloop_timeout_cancel(&upd->timeout);
+	if (list_empty(&upd->tx_list))
+		list_add_tail(&upd->tx_list, &update_tx_list);
+
+	if (!update_tx_timer.pending)
+		uloop_timeout_set(&update_tx_timer, 0);
+}
+
+static void
+network_pex_update_resend_send(void *priv, union network_endpoint *ep, bool ext)
+{
+	struct network *net = priv;
+
+	if (__pex_msg_send(ext ? -1 : net->pex.fd.fd, ep, NULL, 0) < 0)
+		D_NET(net, "pex resend request failed: %s", strerror(errno));
+}
+
+/* the transfer completed or failed, allow pulling the version again */
+static void
+network_pex_update_pull_done(struct network *net)
+{
+	net->pex.update_pending_version = 0;
+	net->pex.update_pending_time = 0;
+}
+
+static void
+network_pex_update_resend_cb(struct uloop_timeout *t)
+{
+	struct network *net = container_of(t, struct network, pex.update_resend_timer);
+
+	if (pex_msg_update_request_resend(net->config.auth_key,
+					  network_pex_update_resend_send, net))
+		uloop_timeout_set(t, NETWORK_PEX_RESEND_INTERVAL);
+	else
+		network_pex_update_pull_done(net);
+}
+
+static void
+network_pex_announce_cb(struct uloop_timeout *t)
+{
+	struct network *net = container_of(t, struct network, pex.announce_timer);
+	struct network_peer *sel[NETWORK_PEX_GOSSIP_FANOUT];
+	struct pex_update_announce *ann;
+	struct network_peer *peer;
+	int i, n = 0, seen = 0;
+
+	if (!net->net_data_len)
+		return;
+
+	/*
+	 * random selection among peers that may not have the current version,
+	 * a peer is only known to have it once it requested or announced it
+	 */
+	vlist_for_each_element(&net->peers, peer, node) {
+		if (!peer->state.connected || !peer->pex_port ||
+		    !peer->state.announce_supported ||
+		    peer->state.net_data_version >= net->net_data_version)
+			continue;
+
+		if (seen < NETWORK_PEX_GOSSIP_FANOUT) {
+			sel[n++] = peer;
+		} else {
+			i = random() % (seen + 1);
+			if (i < NETWORK_PEX_GOSSIP_FANOUT)
+				sel[i] = peer;
+		}
+		seen++;
+	}
+
+	for (i = 0; i < n; i++) {
+		peer = sel[i];
+		D_PEER(net, peer, "announce network data version %"PRIu64,
+		       net->net_data_version);
+		pex_msg_init(net, PEX_MSG_UPDATE_ANNOUNCE);
+		ann = pex_msg_append(sizeof(*ann));
+		ann->cur_version = cpu_to_be64(net->net_data_version);
+		pex_msg_send(net, peer);
+	}
+
+	if (seen > n && --net->pex.announce_rounds > 0)
+		uloop_timeout_set(t, NETWORK_PEX_GOSSIP_INTERVAL);
+}
+
 void network_pex_init(struct network *net)
 {
 	struct network_pex *pex = &net->pex;
@@ -326,7 +771,11 @@ void network_pex_init(struct network *net)
 	memset(pex, 0, sizeof(*pex));
 	pex->fd.fd = -1;
 	INIT_LIST_HEAD(&pex->hosts);
+	INIT_LIST_HEAD(&pex->updates);
 	pex->request_update_timer.cb = network_pex_request_update_cb;
+	pex->update_resend_timer.cb = network_pex_update_resend_cb;
+	pex->announce_timer.cb = network_pex_announce_cb;
+	pex->endpoint_notify_timer.cb = network_pex_endpoint_notify_cb;
 }
 
 static void
@@ -397,10 +846,49 @@ network_pex_send_ping(struct network *net, struct network_peer *peer)
 	peer->state.ping_wait = 1 + net->net_config.keepalive / 2;
 }
 
+void network_pex_probe_endpoints(struct network *net, struct network_peer *peer)
+{
+	union network_endpoint *cand = peer->state.next_endpoint;
+	struct pex_endpoint_probe *data;
+	union network_endpoint ep;
+	int i, j;
+
+	if (net->config.type != NETWORK_TYPE_DYNAMIC)
+		return;
+
+	memset(peer->state.probe_id, 0, sizeof(peer->state.probe_id));
+	peer->state.probe_done = false;
+	peer->state.probe_sent = unet_gettime_ms();
+
+	for (i = 0; i < __ENDPOINT_TYPE_MAX; i++) {
+		if (!cand[i].sa.sa_family)
+			continue;
+
+		/* a reply only confirms the address, probe each one once */
+		for (j = 0; j < i; j++)
+			if (network_endpoint_addr_equal(&cand[i], &cand[j]))
+				break;
+		if (j < i)
+			continue;
+
+		randombytes(&peer->state.probe_id[i], sizeof(peer->state.probe_id[i]));
+
+		memcpy(&ep, &cand[i], sizeof(ep));
+		ep.in.sin_port = htons(global_pex_port);
+
+		pex_msg_init_ext(net, PEX_MSG_PING, true);
+		data = pex_msg_append(sizeof(*data));
+		data->id = peer->state.probe_id[i];
+		if (__pex_msg_send(-1, &ep, NULL, 0) < 0)
+			D_PEER(net, peer, "endpoint probe failed: %s", strerror(errno));
+	}
+}
+
 static void
 network_pex_send_update_request(struct network *net, struct network_peer *peer,
 				struct sockaddr_in6 *addr)
 {
+	struct pex_update_request *req;
 	union network_endpoint ep = {};
 	uint64_t version = 0;
 
@@ -412,14 +900,72 @@ network_pex_send_update_request(struct network *net, struct network_peer *peer,
 	if (net->net_data_len)
 		version = net->net_data_version;
 
-	if (!pex_msg_update_request_init(net->config.pubkey, net->config.key,
-					 net->config.auth_key, &ep,
-					 version, !!addr))
+	req = pex_msg_update_request_init(net->config.pubkey, net->config.key,
+					  net->config.auth_key, &ep, version,
+					  net->config.data_size_max, !!addr);
+	if (!req)
 		return;
 
+	req->flags = cpu_to_be32(network_pex_update_request_flags(net));
+
 	pex_msg_send_ext(net, peer, addr);
 }
 
+static void
+network_pex_announce(struct network *net)
+{
+	struct network_peer *peer;
+
+	/* older peers ignore announces, push the update request to them instead */
+	vlist_for_each_element(&net->peers, peer, node)
+		if (peer->state.connected && peer->pex_port &&
+		    !peer->state.announce_supported)
+			network_pex_send_update_request(net, peer, NULL);
+
+	net->pex.announce_rounds = NETWORK_PEX_GOSSIP_ROUNDS;
+	uloop_timeout_set(&net->pex.announce_timer, 1);
+}
+
+/* fetch a newer version, unless a transfer of it is already in flight */
+static void
+network_pex_update_pull(struct network *net, struct network_peer *peer,
+			struct sockaddr_in6 *addr, uint64_t version)
+{
+	struct network_pex *pex = &net->pex;
+	uint64_t now = unet_gettime();
+
+	if (version <= pex->update_pending_version &&
+	    now < pex->update_pending_time + NETWORK_PEX_UPDATE_PENDING_TIMEOUT)
+		return;
+
+	pex->update_pending_version = version;
+	pex->update_pending_time = now;
+	network_pex_send_update_request(net, peer, addr);
+}
+
+static void
+network_pex_recv_update_announce(struct network *net, struct network_peer *peer,
+				 const void *data, size_t len)
+{
+	const struct pex_update_announce *ann = data;
+	uint64_t version;
+
+	if (len < sizeof(*ann) || net->config.type != NETWORK_TYPE_DYNAMIC)
+		return;
+
+	peer->state.announce_supported = true;
+	version = be64_to_cpu(ann->cur_version);
+	if (version > peer->state.net_data_version)
+		peer->state.net_data_version = version;
+
+	if (version <= net->net_data_version)
+		return;
+
+	D_PEER(net, peer, "received announce for network data version %"PRIu64,
+	       version);
+	network_pex_update_pull(net, peer, NULL, version);
+}
+
 void network_pex_event(struct network *net, struct network_peer *peer,
 		       enum pex_event ev)
 {
@@ -456,11 +1002,13 @@ network_pex_recv_hello(struct network *net, struct network_peer *peer,
 	if (len < sizeof(*data))
 		return;
 
+	flags = ntohs(data->flags);
+	peer->state.announce_supported = !!(flags & PEX_HELLO_F_ANNOUNCE);
+
 	if (peer->state.has_local_ep_addr &&
 	    !memcmp(&peer->state.local_ep_addr, data->local_addr, sizeof(data->local_addr)))
 		return;
 
-	flags = ntohs(data->flags);
 	af = (flags & PEER_EP_F_IPV6) ? AF_INET6 : AF_INET;
 	D_PEER(net, peer, "set local endpoint address to %s",
 	       inet_ntop(af, data->local_addr, addrstr, sizeof(addrstr)));
@@ -476,7 +1024,7 @@ network_pex_recv_peers(struct network *net, struct network_peer *peer,
 	struct network_peer *cur;
 
 	for (; len >= sizeof(*data); len -= sizeof(*data), data++) {
-		union network_endpoint *ep;
+		union network_endpoint ep = {};
 		uint16_t flags;
 		void *addr;
 		int len;
@@ -493,11 +1041,11 @@ network_pex_recv_peers(struct network *net, struct network_peer *peer,
 		D_PEER(net, peer, "received peer address for %s",
 		       network_peer_name(cur));
 		flags = ntohs(data->flags);
-		ep = &cur->state.next_endpoint[ENDPOINT_TYPE_PEX];
-		ep->sa.sa_family = (flags & PEER_EP_F_IPV6) ? AF_INET6 : AF_INET;
-		addr = network_endpoint_addr(ep, &len);
+		ep.sa.sa_family = (flags & PEER_EP_F_IPV6) ? AF_INET6 : AF_INET;
+		addr = network_endpoint_addr(&ep, &len);
 		memcpy(addr, data->addr, len);
-		ep->in.sin_port = data->port;
+		ep.in.sin_port = data->port;
+		network_peer_set_next_endpoint(net, cur, ENDPOINT_TYPE_PEX, &ep);
 	}
 }
 
@@ -544,6 +1092,156 @@ network_pex_recv_ping(struct network *net, struct network_peer *peer)
 	pex_msg_send(net, peer);
 }
 
+static struct {
+	siphash_key_t key[2];
+	uint64_t key_time;
+
+	uint64_t time;
+	unsigned int count;
+	uint64_t active_until;
+} pex_cookie;
+
+static struct global_pex_src_bucket {
+	struct sockaddr_in6 addr;
+	uint64_t time;
+	unsigned int tokens;
+} pex_src_buckets[GLOBAL_PEX_SRC_BUCKETS];
+
+static void
+global_pex_cookie(uint8_t *cookie, struct network *net, struct sockaddr_in6 *addr,
+		  int key_idx)
+{
+	struct {
+		uint8_t addr[16];
+		uint16_t port;
+		uint8_t auth_id[PEX_ID_LEN];
+	} __packed data = {};
+
+	memcpy(data.addr, &addr->sin6_addr, sizeof(data.addr));
+	data.port = addr->sin6_port;
+	memcpy(data.auth_id, net->config.auth_key, sizeof(data.auth_id));
+	siphash_to_le64(cookie, &data, sizeof(data), &pex_cookie.key[key_idx]);
+}
+
+static bool
+global_pex_cookie_valid(struct network *net, struct sockaddr_in6 *addr,
+			const uint8_t *cookie)
+{
+	uint8_t cur[PEX_COOKIE_LEN];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pex_cookie.key); i++) {
+		global_pex_cookie(cur, net, addr, i);
+		if (!memcmp(cur, cookie, sizeof(cur)))
+			return true;
+	}
+
+	return false;
+}
+
+static void
+global_pex_cookie_key_update(uint64_t now)
+{
+	/* both keys must be secret, the previous one is still accepted */
+	if (!pex_cookie.key_time) {
+		randombytes(pex_cookie.key, sizeof(pex_cookie.key));
+		pex_cookie.key_time = now;
+		return;
+	}
+
+	if (now < pex_cookie.key_time + GLOBAL_PEX_COOKIE_ROTATE)
+		return;
+
+	pex_cookie.key[1] = pex_cookie.key[0];
+	randombytes(&pex_cookie.key[0], sizeof(pex_cookie.key[0]));
+	pex_cookie.key_time = now;
+}
+
+static bool
+global_pex_src_allowed(struct sockaddr_in6 *addr, uint64_t now)
+{
+	struct global_pex_src_bucket *b;
+	uint32_t hash;
+
+	global_pex_cookie_key_update(now);
+	hash = siphash(addr, sizeof(*addr), &pex_cookie.key[0]);
+	b = &pex_src_buckets[hash % GLOBAL_PEX_SRC_BUCKETS];
+	if (memcmp(&b->addr, addr, sizeof(*addr)) != 0) {
+		memcpy(&b->addr, addr, sizeof(*addr));
+		b->time = now;
+		b->tokens = GLOBAL_PEX_SRC_BURST;
+	}
+
+	if (now > b->time) {
+		b->tokens += (now - b->time) * GLOBAL_PEX_SRC_RATE;
+		if (b->tokens > GLOBAL_PEX_SRC_BURST)
+			b->tokens = GLOBAL_PEX_SRC_BURST;
+		b->time = now;
+	}
+
+	if (!b->tokens)
+		return false;
+
+	b->tokens--;
+	return true;
+}
+
+/* accounts for an unauthenticated request, returns true if cookies are required */
+static bool
+global_pex_cookie_required(uint64_t now)
+{
+	global_pex_cookie_key_update(now);
+
+	if (pex_cookie.time != now) {
+		pex_cookie.time = now;
+		pex_cookie.count = 0;
+	}
+
+	if (++pex_cookie.count > GLOBAL_PEX_COOKIE_THRESHOLD)
+		pex_cookie.active_until = now + GLOBAL_PEX_COOKIE_HOLD;
+
+	return now < pex_cookie.active_until;
+}
+
+/* returns true if an update request from outside the tunnel may be handled */
+static bool
+global_pex_update_request_check(struct network *net, struct pex_update_request *req,
+				size_t len, struct sockaddr_in6 *addr)
+{
+	struct pex_update_cookie *res;
+	uint64_t now = unet_gettime();
+
+	if (global_pex_cookie_required(now) &&
+	    (len < PEX_UPDATE_REQUEST_COOKIE_LEN ||
+	     !global_pex_cookie_valid(net, addr, req->cookie))) {
+		/* cheap and smaller than the request, no amplification */
+		pex_msg_init_ext(net, PEX_MSG_UPDATE_COOKIE, true);
+		res = pex_msg_append(sizeof(*res));
+		res->req_id = req->req_id;
+		global_pex_cookie(res->cookie, net, addr, 0);
+		pex_msg_send_ext(net, NULL, addr);
+		return false;
+	}
+
+	return global_pex_src_allowed(addr, now);
+}
+
+/*
+ * Resend requests carry no cookie, under load they are only accepted for
+ * transfers that were started by a request with a valid one.
+ */
+static bool
+global_pex_update_resend_check(struct network_pex_update *upd,
+			       struct sockaddr_in6 *addr)
+{
+	uint64_t now = unet_gettime();
+
+	if (global_pex_cookie_required(now) && !upd->cookie)
+		return false;
+
+	return global_pex_src_allowed(addr, now);
+}
+
 static void
 network_pex_recv_update_request(struct network *net, struct network_peer *peer,
 				const uint8_t *data, size_t len,
@@ -551,17 +1249,26 @@ network_pex_recv_update_request(struct network *net, struct network_peer *peer,
 {
 	struct pex_update_request *req = (struct pex_update_request *)data;
 	struct pex_endpoint_port_notify *port_data;
-	struct pex_msg_update_send_ctx ctx = {};
+	struct network_pex_update *upd;
 	uint64_t req_version = be64_to_cpu(req->cur_version);
+	uint32_t flags = 0;
+	const void *res_data;
+	size_t res_len;
 	int *query_count;
-	bool done = false;
+	uint32_t enc_flags;
 
-	if (len < sizeof(struct pex_update_request))
+	if (len < PEX_UPDATE_REQUEST_MIN_LEN)
 		return;
 
+	if (len >= PEX_UPDATE_REQUEST_FLAGS_LEN)
+		flags = be32_to_cpu(req->flags);
+
 	if (net->config.type != NETWORK_TYPE_DYNAMIC)
 		return;
 
+	if (addr && !global_pex_update_request_check(net, req, len, addr))
+		return;
+
 	if (peer)
 		query_count = &peer->state.num_net_queries;
 	else
@@ -582,8 +1289,11 @@ network_pex_recv_update_request(struct network *net, struct network_peer *peer,
 		pex_msg_send_ext(net, peer, addr);
 	}
 
+	if (peer && req_version > peer->state.net_data_version)
+		peer->state.net_data_version = req_version;
+
 	if (req_version > net->net_data_version)
-		network_pex_send_update_request(net, peer, addr);
+		network_pex_update_pull(net, peer, addr, req_version);
 	else if (!peer && net->net_data_len) {
 		struct pex_update_response_no_data *res;
 
@@ -600,14 +1310,28 @@ network_pex_recv_update_request(struct network *net, struct network_peer *peer,
 	if (req_version >= net->net_data_version)
 		goto out;
 
-	pex_msg_update_response_init(&ctx, net->config.pubkey, net->config.auth_key,
-				     peer->key, !!addr, (void *)data,
-				     net->net_data, net->net_data_len);
-	while (!done) {
-		pex_msg_send_ext(net, peer, addr);
-		done = !pex_msg_update_response_continue(&ctx);
+	if (!addr && !peer->pex_port)
+		goto out;
+
+	/* sent from the transmit timer, paced across all transfers */
+	enc_flags = network_pex_update_encode(net, req_version, flags,
+					      &res_data, &res_len);
+	upd = network_pex_update_alloc(net, peer, addr);
+	if (!upd) {
+		D_PEER(net, peer, "too many update transfers in progress");
+		goto out;
 	}
 
+	upd->ctx.flags = enc_flags;
+	upd->cookie = addr && len >= PEX_UPDATE_REQUEST_COOKIE_LEN &&
+		      global_pex_cookie_valid(net, addr, req->cookie);
+	pex_msg_update_response_init(&upd->ctx, net->config.pubkey, net->config.auth_key,
+				     peer->key, !!addr, (void *)data,
+				     res_data, res_len);
+	pex_msg_update_response_seek(&upd->ctx, 0, upd->ctx.len);
+	network_pex_update_start(upd);
+	peer->state.net_data_version = net->net_data_version;
+
 out:
 	if (peer->state.connected || !net->net_config.local_host)
 		return;
@@ -623,11 +1347,100 @@ out:
 	pex_msg_send_ext(net, peer, addr);
 }
 
+static int
+network_pex_resend_range_cmp(const void *a, const void *b)
+{
+	const struct pex_update_resend_range *r1 = a, *r2 = b;
+
+	return (r1->offset > r2->offset) - (r1->offset < r2->offset);
+}
+
+static void
+network_pex_recv_update_resend(struct network *net, const uint8_t *data, size_t len,
+			       struct sockaddr_in6 *addr)
+{
+	const struct pex_update_resend *req = (const void *)data;
+	const struct pex_update_resend_range *range;
+	struct pex_update_resend_range *r;
+	struct network_pex_update *upd;
+	uint32_t offset, end, size;
+	size_t i;
+	int n = 0;
+
+	if (len < sizeof(*req))
+		return;
+
+	list_for_each_entry(upd, &net->pex.updates, list)
+		if (upd->ctx.req_id == req->req_id)
+			goto found;
+
+	return;
+
+found:
+	/* only the receiver of the transfer may ask for data to be sent again */
+	if (memcmp(&addr->sin6_addr, &upd->addr.sin6_addr, sizeof(addr->sin6_addr)) != 0 ||
+	    addr->sin6_port != upd->addr.sin6_port)
+		return;
+
+	if (upd->ctx.ext && !global_pex_update_resend_check(upd, addr))
+		return;
+
+	if (upd->resend++ >= NETWORK_PEX_UPDATE_RESEND_MAX)
+		return;
+
+	/* missing data means loss, slow down */
+	upd->rate = upd->rate > 1 ? upd->rate / 2 : 1;
+
+	range = (const void *)(req + 1);
+	len = (len - sizeof(*req)) / sizeof(*range);
+	if (len > PEX_UPDATE_RESEND_RANGES_MAX)
+		len = PEX_UPDATE_RESEND_RANGES_MAX;
+	if (!len)
+		return;
+
+	size = upd->ctx.len;
+	r = realloc(upd->ranges, len * sizeof(*upd->ranges));
+	if (!r)
+		return;
+
+	for (i = 0; i < len; i++) {
+		offset = be32_to_cpu(range[i].offset);
+		if (offset >= size)
+			continue;
+
+		r[n].offset = offset;
+		r[n].len = be32_to_cpu(range[i].len);
+		if (r[n].len > size - offset)
+			r[n].len = size - offset;
+		if (r[n].len)
+			n++;
+	}
+
+	/* merge overlapping ranges, nothing is sent more than once per request */
+	qsort(r, n, sizeof(*r), network_pex_resend_range_cmp);
+	for (i = 1, len = n, n = !!len; i < len; i++) {
+		end = r[n - 1].offset + r[n - 1].len;
+		if (r[i].offset > end) {
+			r[n++] = r[i];
+			continue;
+		}
+
+		if (r[i].offset + r[i].len > end)
+			r[n - 1].len = r[i].offset + r[i].len - r[n - 1].offset;
+	}
+
+	upd->ranges = r;
+	upd->n_ranges = n;
+	upd->cur_range = 0;
+	D_NET(net, "resend %d update response data ranges, rate=%d", n, upd->rate);
+
+	network_pex_update_start(upd);
+}
+
 static void
 network_pex_recv_update_response(struct network *net, const uint8_t *data, size_t len,
 			      struct sockaddr_in6 *addr, enum pex_opcode op)
 {
-	struct network_peer *peer;
 	void *net_data;
 	int net_data_len = 0;
 	uint64_t version = 0;
@@ -636,38 +1449,43 @@ network_pex_recv_update_response(struct network *net, const uint8_t *data, size_
 	if (net->config.type != NETWORK_TYPE_DYNAMIC)
 		return;
 
-	net_data = pex_msg_update_response_recv(data, len, op, &net_data_len, &version);
+	net_data = pex_msg_update_response_recv(data, len, op, &net_data_len, &version,
+						net->net_data, net->net_data_len);
 	if (!net_data) {
 		if (op == PEX_MSG_UPDATE_RESPONSE_REFUSED && net_data_len == -1 &&
 		    version > net->net_data_version)
 			net->update_refused++;
+
+		if (net_data_len == -1)
+			network_pex_update_pull_done(net);
+
+		/* ask for missing chunks once the response stalls */
+		if (!net_data_len && (op == PEX_MSG_UPDATE_RESPONSE ||
+				      op == PEX_MSG_UPDATE_RESPONSE_ENCODED ||
+				      op == PEX_MSG_UPDATE_RESPONSE_DATA))
+			uloop_timeout_set(&net->pex.update_resend_timer,
+					  NETWORK_PEX_RESEND_DELAY);
 		return;
 	}
 
+	network_pex_update_pull_done(net);
 	if (version <= net->net_data_version) {
 		free(net_data);
 		return;
 	}
 
 	D_NET(net, "received updated network data, len=%d", net_data_len);
-	free(net->net_data);
-
-	net->net_data = net_data;
-	net->net_data_len = net_data_len;
-	net->net_data_version = version;
+	network_set_data(net, net_data, net_data_len, version);
 	if (network_save_dynamic(net) < 0)
 		return;
 
 	uloop_timeout_set(&net->reload_timer, no_prev_data ? 1 : UNETD_DATA_UPDATE_DELAY);
-	vlist_for_each_element(&net->peers, peer, node) {
-		if (!peer->state.connected || !peer->pex_port)
-			continue;
-		network_pex_send_update_request(net, peer, NULL);
-	}
+	network_pex_announce(net);
 }
 
 static void
-network_pex_recv(struct network *net, struct network_peer *peer, struct pex_hdr *hdr)
+network_pex_recv(struct network *net, struct network_peer *peer, struct pex_hdr *hdr,
+		 struct sockaddr_in6 *addr)
 {
 	const void *data = hdr + 1;
 
@@ -695,63 +1513,72 @@ network_pex_recv(struct network *net, struct network_peer *peer, struct pex_hdr
 						NULL);
 		break;
 	case PEX_MSG_UPDATE_RESPONSE:
+	case PEX_MSG_UPDATE_RESPONSE_ENCODED:
 	case PEX_MSG_UPDATE_RESPONSE_DATA:
 	case PEX_MSG_UPDATE_RESPONSE_NO_DATA:
 	case PEX_MSG_UPDATE_RESPONSE_REFUSED:
 		network_pex_recv_update_response(net, data, hdr->len,
 					      NULL, hdr->opcode);
 		break;
+	case PEX_MSG_UPDATE_ANNOUNCE:
+		network_pex_recv_update_announce(net, peer, data, hdr->len);
+		break;
+	case PEX_MSG_UPDATE_RESEND:
+		network_pex_recv_update_resend(net, data, hdr->len, addr);
+		break;
 	case PEX_MSG_ENDPOINT_NOTIFY:
 		break;
 	}
 }
 
 static void
-network_pex_fd_cb(struct uloop_fd *fd, unsigned int events)
+network_pex_fd_recv(struct network *net, void *buf, size_t len,
+		    struct sockaddr_in6 *sin6)
 {
-	struct network *net = container_of(fd, struct network, pex.fd);
 	struct network_peer *local = &net->net_config.local_host->peer;
 	struct network_peer *peer;
-	struct sockaddr_in6 sin6;
-	static char buf[PEX_BUF_SIZE];
-	struct pex_hdr *hdr = (struct pex_hdr *)buf;
-	ssize_t len;
-
-	while (1) {
-		socklen_t slen = sizeof(sin6);
-
-		len = recvfrom(fd->fd, buf, sizeof(buf), 0, (struct sockaddr *)&sin6, &slen);
-		if (len < 0) {
-			if (errno == EINTR)
-				continue;
+	struct pex_hdr *hdr;
 
-			if (errno == EAGAIN)
-				break;
+	if (!len)
+		return;
 
-			D_NET(net, "recvfrom failed: %s", strerror(errno));
-			network_pex_close(net);
-			return;
-		}
+	hdr = pex_rx_accept(buf, len, false);
+	if (!hdr)
+		return;
 
-		if (!len)
-			continue;
+	peer = pex_msg_peer(net, hdr->id, false);
+	if (!peer)
+		return;
 
-		hdr = pex_rx_accept(buf, len, false);
-		if (!hdr)
-			continue;
+	if (memcmp(&sin6->sin6_addr, &peer->local_addr.in6, sizeof(sin6->sin6_addr)) != 0)
+		return;
 
-		peer = pex_msg_peer(net, hdr->id, false);
-		if (!peer)
-			continue;
+	if (peer == local)
+		return;
 
-		if (memcmp(&sin6.sin6_addr, &peer->local_addr.in6, sizeof(sin6.sin6_addr)) != 0)
-			continue;
+	network_pex_recv(net, peer, hdr, sin6);
+}
 
-		if (peer == local)
-			continue;
+static void
+network_pex_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct network *net = container_of(fd, struct network, pex.fd);
+	static struct sockaddr_in6 addr[UDP_RX_BATCH];
+	static char buf[UDP_RX_BATCH][PEX_BUF_SIZE];
+	size_t len[UDP_RX_BATCH];
+	int i, n;
+
+	do {
+		n = udp_recv_batch(fd->fd, buf, sizeof(buf[0]), len, addr, UDP_RX_BATCH);
+		if (n < 0) {
+			D_NET(net, "recvmmsg failed: %s", strerror(errno));
+			network_pex_close(net);
+			return;
+		}
 
-		network_pex_recv(net, peer, hdr);
-	}
+		for (i = 0; i < n && net->pex.fd.fd >= 0; i++)
+			network_pex_fd_recv(net, buf[i], len[i], &addr[i]);
+	} while (n == UDP_RX_BATCH && net->pex.fd.fd >= 0);
 }
 
 struct network_pex_host *
@@ -762,11 +1589,10 @@ network_pex_create_host(struct network *net, union network_endpoint *ep,
 	struct network_pex_host *host;
 	uint64_t now = unet_gettime();
 	bool new_host = false;
+	unsigned int hash;
 
-	list_for_each_entry(host, &pex->hosts, list) {
-		if (memcmp(&host->endpoint, ep, sizeof(host->endpoint)) != 0)
-			continue;
-
+	host = network_pex_host_find(pex, ep);
+	if (host) {
 		if (host->last_ping + 10 < now) {
 			list_move_tail(&host->list, &pex->hosts);
 			network_pex_host_request_update(net, host);
@@ -778,6 +1604,9 @@ network_pex_create_host(struct network *net, union network_endpoint *ep,
 	new_host = true;
 	memcpy(&host->endpoint, ep, sizeof(host->endpoint));
 	list_add_tail(&host->list, &pex->hosts);
+	hash = network_pex_host_hash(&host->endpoint);
+	host->hash_next = pex->host_hash[hash];
+	pex->host_hash[hash] = host;
 	pex->num_hosts++;
 
 out:
@@ -906,6 +1735,18 @@ void network_pex_reload(void)
 	uloop_timeout_set(&timer, 1);
 }
 
+static void
+network_pex_close_socket(struct network *net)
+{
+	struct network_pex *pex = &net->pex;
+
+	/* don't leave queued packets behind for a closed socket */
+	pex_msg_flush();
+	uloop_fd_delete(&pex->fd);
+	close(pex->fd.fd);
+	network_pex_init(net);
+}
+
 int network_pex_open(struct network *net)
 {
 	struct network_host *local_host = net->net_config.local_host;
@@ -915,13 +1756,25 @@ int network_pex_open(struct network *net)
 	int yes = 1;
 	int fd;
 
+	if (local_host && local_host->peer.pex_port) {
+		local = &local_host->peer;
+		sin6.sin6_family = AF_INET6;
+		memcpy(&sin6.sin6_addr, &local->local_addr.in6,
+		       sizeof(local->local_addr.in6));
+		sin6.sin6_port = htons(local->pex_port);
+	}
+
+	/* socket kept by network_pex_suspend */
+	if (pex->fd.fd >= 0 && memcmp(&pex->addr, &sin6, sizeof(sin6)) != 0)
+		network_pex_close_socket(net);
+
+	global_pex_net_hash_add(net);
 	network_pex_open_auth_connect(net);
 	__network_pex_reload(net);
 
-	if (!local_host || !local_host->peer.pex_port)
+	if (!sin6.sin6_port || pex->fd.fd >= 0)
 		return 0;
 
-	local = &local_host->peer;
 	fd = socket(PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
 	if (fd < 0)
 		return -1;
@@ -929,11 +1782,6 @@ int network_pex_open(struct network *net)
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 
-	sin6.sin6_family = AF_INET6;
-	memcpy(&sin6.sin6_addr, &local->local_addr.in6,
-	       sizeof(local->local_addr.in6));
-	sin6.sin6_port = htons(local_host->peer.pex_port);
-
 	if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
 		perror("bind");
 		goto close;
@@ -949,6 +1797,7 @@ int network_pex_open(struct network *net)
 	pex->fd.fd = fd;
 	pex->fd.cb = network_pex_fd_cb;
 	uloop_fd_add(&pex->fd, ULOOP_READ);
+	pex->addr = sin6;
 
 	return 0;
 
@@ -957,12 +1806,14 @@ close:
 	return -1;
 }
 
-void network_pex_close(struct network *net)
+static void
+__network_pex_close(struct network *net, bool keep_socket)
 {
 	struct network_pex *pex = &net->pex;
 	struct network_pex_host *host, *tmp;
 	uint64_t now = unet_gettime();
 
+	global_pex_net_hash_del(net);
 	uloop_timeout_cancel(&pex->request_update_timer);
 	list_for_each_entry_safe(host, tmp, &pex->hosts, list) {
 		if (host->timeout)
@@ -974,12 +1825,25 @@ void network_pex_close(struct network *net)
 		network_pex_free_host(net, host);
 	}
 
-	if (pex->fd.fd < 0)
+	uloop_timeout_cancel(&pex->update_resend_timer);
+	uloop_timeout_cancel(&pex->announce_timer);
+	uloop_timeout_cancel(&pex->endpoint_notify_timer);
+	network_pex_updates_free(net);
+	if (pex->fd.fd < 0 || keep_socket)
 		return;
 
-	uloop_fd_delete(&pex->fd);
-	close(pex->fd.fd);
-	network_pex_init(net);
+	network_pex_close_socket(net);
+}
+
+void network_pex_close(struct network *net)
+{
+	__network_pex_close(net, false);
+}
+
+/* stop PEX activity for a reload, the socket is reused by network_pex_open */
+void network_pex_suspend(struct network *net)
+{
+	__network_pex_close(net, true);
 }
 
 void network_pex_free(struct network *net)
@@ -989,6 +1853,11 @@ void network_pex_free(struct network *net)
 
 	list_for_each_entry_safe(host, tmp, &pex->hosts, list)
 		network_pex_free_host(net, host);
+
+	uloop_timeout_cancel(&pex->update_resend_timer);
+	uloop_timeout_cancel(&pex->announce_timer);
+	uloop_timeout_cancel(&pex->endpoint_notify_timer);
+	network_pex_updates_free(net);
 }
 
 static struct network *
@@ -996,10 +1865,10 @@ global_pex_find_network(const uint8_t *id)
 {
 	struct network *net;
 
-	avl_for_each_element(&networks, net, node) {
+	net = global_pex_net_hash[global_pex_net_hash_idx(id)];
+	for (; net; net = net->pex.hash_next)
 		if (!memcmp(id, net->config.auth_key, PEX_ID_LEN))
 			return net;
-	}
 
 	return NULL;
 }
@@ -1007,14 +1876,48 @@ global_pex_find_network(const uint8_t *id)
 static void
 global_pex_set_active(struct network *net, struct sockaddr_in6 *addr)
 {
-	struct network_pex *pex = &net->pex;
 	struct network_pex_host *host;
+	union network_endpoint ep = {
+		.in6 = *addr
+	};
+
+	host = network_pex_host_find(&net->pex, &ep);
+	if (host)
+		host->last_active = unet_gettime();
+}
+
+static void
+global_pex_recv_probe(struct network *net, const struct pex_endpoint_probe *probe,
+		      size_t len, struct sockaddr_in6 *addr)
+{
+	struct pex_endpoint_probe *data;
+
+	if (len < sizeof(*probe) || !global_pex_src_allowed(addr, unet_gettime()))
+		return;
+
+	pex_msg_init_ext(net, PEX_MSG_PONG, true);
+	data = pex_msg_append(sizeof(*data));
+	data->id = probe->id;
+	pex_msg_send_ext(net, NULL, addr);
+}
+
+static void
+global_pex_recv_probe_reply(struct network *net, struct network_peer *peer,
+			    const struct pex_endpoint_probe *probe, size_t len)
+{
+	int i;
 
-	list_for_each_entry(host, &pex->hosts, list) {
-		if (memcmp(&host->endpoint.in6, addr, sizeof(*addr)) != 0)
+	if (len < sizeof(*probe) || !probe->id)
+		return;
+
+	for (i = 0; i < __ENDPOINT_TYPE_MAX; i++) {
+		if (peer->state.probe_id[i] != probe->id)
 			continue;
 
-		host->last_active = unet_gettime();
+		peer->state.probe_id[i] = 0;
+		network_peer_probe_reply(net, peer, i,
+					 unet_gettime_ms() - peer->state.probe_sent);
+		return;
 	}
 }
 
@@ -1023,6 +1926,7 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 {
 	struct pex_hdr *hdr;
 	struct pex_ext_hdr *ehdr;
+	struct pex_update_request *req;
 	struct network_peer *peer;
 	struct network *net = NULL;
 	char buf[INET6_ADDRSTRLEN];
@@ -1032,6 +1936,7 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 	union network_endpoint host_ep = {
 		.in6 = *addr
 	};
+	union network_endpoint ep = {};
 
 	if (stun_msg_is_valid(msg, msg_len)) {
 		avl_for_each_element(&networks, net, node)
@@ -1063,8 +1968,16 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 	case PEX_MSG_HELLO:
 	case PEX_MSG_NOTIFY_PEERS:
 	case PEX_MSG_QUERY:
+		break;
 	case PEX_MSG_PING:
+		peer = pex_msg_peer(net, hdr->id, true);
+		if (peer)
+			global_pex_recv_probe(net, data, hdr->len, addr);
+		break;
 	case PEX_MSG_PONG:
+		peer = pex_msg_peer(net, hdr->id, true);
+		if (peer)
+			global_pex_recv_probe_reply(net, peer, data, hdr->len);
 		break;
 	case PEX_MSG_UPDATE_REQUEST:
 		peer = pex_msg_peer(net, hdr->id, true);
@@ -1072,6 +1985,7 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 						addr);
 		break;
 	case PEX_MSG_UPDATE_RESPONSE:
+	case PEX_MSG_UPDATE_RESPONSE_ENCODED:
 		if (net->pex.num_hosts < NETWORK_PEX_HOSTS_LIMIT)
 			network_pex_create_host(net, &host_ep, 20);
 		fallthrough;
@@ -1080,6 +1994,17 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 	case PEX_MSG_UPDATE_RESPONSE_REFUSED:
 		network_pex_recv_update_response(net, data, hdr->len, addr, hdr->opcode);
 		break;
+	case PEX_MSG_UPDATE_RESEND:
+		network_pex_recv_update_resend(net, data, hdr->len, addr);
+		break;
+	case PEX_MSG_UPDATE_COOKIE:
+		req = pex_msg_update_request_cookie(data, hdr->len);
+		if (!req)
+			break;
+
+		req->flags = cpu_to_be32(network_pex_update_request_flags(net));
+		pex_msg_send_ext(net, NULL, addr);
+		break;
 	case PEX_MSG_ENDPOINT_PORT_NOTIFY:
 		if (hdr->len < sizeof(struct pex_endpoint_port_notify))
 			break;
@@ -1095,14 +2020,15 @@ global_pex_recv(void *msg, size_t msg_len, struct sockaddr_in6 *addr)
 		  inet_ntop(addr->sin6_family, network_endpoint_addr((void *)addr, &addr_len),
 			    buf, sizeof(buf)));
 
-		memcpy(&peer->state.next_endpoint[ep_idx], addr, sizeof(*addr));
+		memcpy(&ep, addr, sizeof(*addr));
 		if (hdr->opcode == PEX_MSG_ENDPOINT_PORT_NOTIFY) {
 			struct pex_endpoint_port_notify *port = data;
 
-			peer->state.next_endpoint[ep_idx].in.sin_port = port->port;
+			ep.in.sin_port = port->port;
 			if (net->pex.num_hosts < NETWORK_PEX_HOSTS_LIMIT)
 				network_pex_create_host(net, &host_ep, 120);
 		}
+		network_peer_set_next_endpoint(net, peer, ep_idx, &ep);
 		break;
 	case PEX_MSG_ENROLL:
 		pex_enroll_recv(data, hdr->len, addr);
@@ -10,11 +10,13 @@
 #include "stun.h"
 
 #define NETWORK_PEX_HOSTS_LIMIT	128
+#define NETWORK_PEX_HOST_HASH_SIZE	64
 
 struct network;
 
 struct network_pex_host {
 	struct list_head list;
+	struct network_pex_host *hash_next;
 	uint64_t timeout;
 	uint64_t last_active;
 	uint64_t last_ping;
@@ -24,9 +26,31 @@ struct network_pex_host {
 
 struct network_pex {
 	struct uloop_fd fd;
+	struct sockaddr_in6 addr;
 	struct list_head hosts;
+	struct network_pex_host *host_hash[NETWORK_PEX_HOST_HASH_SIZE];
 	int num_hosts;
 	struct uloop_timeout request_update_timer;
+
+	/* update responses kept around for resend requests */
+	struct list_head updates;
+	int num_updates;
+	struct uloop_timeout update_resend_timer;
+
+	/* gossip of new network data versions */
+	struct uloop_timeout announce_timer;
+	int announce_rounds;
+
+	/* pending endpoint changes, see network_peer state.endpoint_changed */
+	struct uloop_timeout endpoint_notify_timer;
+
+	/* only one transfer in flight per version */
+	uint64_t update_pending_version;
+	uint64_t update_pending_time;
+
+	/* global PEX port lookup by auth_id */
+	struct network *hash_next;
+	bool hashed;
 };
 
 enum network_stun_state {
@@ -36,22 +60,39 @@ enum network_stun_state {
 	STUN_STATE_STUN_QUERY_WAIT,
 };
 
-struct network_stun_server {
-	struct list_head list;
+struct network_stun_server;
 
+struct network_stun_query {
 	struct avl_node pending_node;
 	struct stun_request req;
+	struct network_stun_server *s;
+	uint64_t sent;
+	bool auth;
+	bool pending;
+};
+
+struct network_stun_server {
+	struct list_head list;
+
+	/* queries for the data and auth port, sent concurrently */
+	struct network_stun_query query[2];
+	uint16_t port[2];
+
+	/* ms, smoothed. the server list is kept sorted by it */
+	unsigned int rtt;
 
 	const char *host;
 	uint8_t seq;
-	bool req_auth_port;
-	bool pending;
 };
 
 struct network_stun {
 	struct list_head servers;
 	struct avl_tree pending;
 
+	/* servers from before a reload, reused if still configured */
+	struct list_head old_servers;
+	bool servers_changed;
+
 	struct uloop_timeout timer;
 
 	enum network_stun_state state;
@@ -76,17 +117,22 @@ enum pex_event {
 void network_pex_init(struct network *net);
 int network_pex_open(struct network *net);
 void network_pex_close(struct network *net);
+void network_pex_suspend(struct network *net);
 void network_pex_free(struct network *net);
+void network_pex_updates_free(struct network *net);
 void network_pex_reload();
 
 void network_pex_event(struct network *net, struct network_peer *peer,
 		       enum pex_event ev);
+void network_pex_probe_endpoints(struct network *net, struct network_peer *peer);
 struct network_pex_host *
 network_pex_create_host(struct network *net, union network_endpoint *ep,
 			unsigned int timeout);
 
 void network_stun_init(struct network *net);
 void network_stun_free(struct network *net);
+void network_stun_update_start(struct network *net);
+void network_stun_update_done(struct network *net);
 void network_stun_server_add(struct network *net, const char *host);
 void network_stun_rx_packet(struct network *net, const void *data, size_t len);
 void network_stun_update_port(struct network *net, bool auth, uint16_t val);
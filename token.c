@@ -114,14 +114,10 @@ token_decrypt(struct network *net, struct token_hdr *hdr, size_t len,
 	void *data;
 
 	data = hdr + 1;
-	memcpy(pubkey, hdr->src, sizeof(hdr->src));
-	peer = avl_find_ge_element(&net->peers.avl, pubkey, peer, node.avl);
+	peer = network_peer_find(net, hdr->src, sizeof(hdr->src));
 	if (!peer || peer == &local_host->peer)
 		return false;
 
-	if (memcmp(peer->key, pubkey, sizeof(hdr->src)) != 0)
-		return false;
-
 	memcpy(pubkey, peer->key, sizeof(pubkey));
 	curve25519(dh_key, net->config.key, pubkey);
 	sha512_init(&s);
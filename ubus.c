@@ -83,6 +83,9 @@ __network_dump(struct blob_buf *buf, struct network *net)
 	if (net->update_refused)
 		blobmsg_add_u32(buf, "update_refused", net->update_refused);
 
+	blobmsg_add_u32(buf, "peer_refresh_time", net->wg.refresh_time);
+	blobmsg_add_u32(buf, "peer_refresh_time_max", net->wg.refresh_time_max);
+
 	c = blobmsg_open_table(buf, "peers");
 	vlist_for_each_element(&net->peers, peer, node) {
 		union network_endpoint *ep = &peer->state.endpoint;
@@ -18,6 +18,7 @@
 #include "wg.h"
 #include "pex-msg.h"
 #include "pex.h"
+#include "lpm.h"
 #include "network.h"
 #include "host.h"
 #include "service.h"
@@ -2,11 +2,13 @@
 /*
  * Copyright (C) 2022 Felix Fietkau <nbd@nbd.name>
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -199,6 +201,15 @@ uint64_t unet_gettime(void)
 	return ts.tv_sec;
 }
 
+uint64_t unet_gettime_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
 static inline uint32_t
 csum_tcpudp_nofold(uint32_t saddr, uint32_t daddr, uint8_t proto, uint32_t len)
 {
@@ -332,3 +343,37 @@ int sendto_rawudp(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen,
 
 	return sendmsg(fd, &msg, 0);
 }
+
+int udp_recv_batch(int fd, void *buf, size_t buf_len, size_t *len,
+		   struct sockaddr_in6 *addr, int n)
+{
+	struct mmsghdr msg[UDP_RX_BATCH] = {};
+	struct iovec iov[UDP_RX_BATCH];
+	int i, ret;
+
+	if (n > UDP_RX_BATCH)
+		n = UDP_RX_BATCH;
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = (char *)buf + i * buf_len;
+		iov[i].iov_len = buf_len;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		if (addr) {
+			msg[i].msg_hdr.msg_name = &addr[i];
+			msg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		}
+	}
+
+	do {
+		ret = recvmmsg(fd, msg, n, 0, NULL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	for (i = 0; i < ret; i++)
+		len[i] = msg[i].msg_len;
+
+	return ret;
+}
@@ -20,6 +20,12 @@ union network_addr {
 	struct in6_addr in6;
 };
 
+struct network_prefix {
+	union network_addr addr;
+	uint8_t af;
+	uint8_t mask;
+};
+
 union network_endpoint {
 	struct sockaddr sa;
 	struct sockaddr_in in;
@@ -126,8 +132,17 @@ int rtnl_init(void);
 int rtnl_call(struct nl_msg *msg);
 
 uint64_t unet_gettime(void);
+uint64_t unet_gettime_ms(void);
 
 int sendto_rawudp(int fd, const void *addr, void *ip_hdr, size_t ip_hdrlen,
 		  const void *data, size_t len);
 
+/*
+ * receive up to n datagrams with a single syscall into consecutive buf_len
+ * sized slots of buf. returns 0 if no data is pending, -1 on error.
+ */
+#define UDP_RX_BATCH	16
+int udp_recv_batch(int fd, void *buf, size_t buf_len, size_t *len,
+		   struct sockaddr_in6 *addr, int n);
+
 #endif
@@ -23,11 +23,16 @@
 #include <netlink/msg.h>
 #include <netlink/attr.h>
 #include <netlink/socket.h>
+#include <netlink/errno.h>
+#include <netlink/handlers.h>
 #include <unl.h>
 
 #include "linux/wireguard.h"
 #include "unetd.h"
 
+/* ms, a dump that has not completed by then is aborted */
+#define WG_LINUX_DUMP_TIMEOUT	3000
+
 struct timespec64 {
 	int64_t tv_sec;
 	int64_t tv_nsec;
@@ -35,12 +40,35 @@ struct timespec64 {
 
 struct wg_linux_peer_req {
 	struct nl_msg *msg;
+	struct network_peer *peer;
 
 	struct nlattr *peers, *entry, *ips;
+
+	/* message carries WGDEVICE_F_REPLACE_PEERS */
+	bool replace_peers;
+
+	int ret;
 };
 
 static struct unl unl;
 
+/* peer requests collected between batch_start and batch_done */
+static struct {
+	struct network *net;
+	struct wg_linux_peer_req req;
+} batch;
+
+/* peer dumps run on a separate non-blocking socket, driven from uloop */
+static struct {
+	struct unl unl;
+	struct uloop_fd fd;
+	struct uloop_timeout timeout;
+	struct nl_cb *cb;
+	struct network *net;
+	uint32_t seq;
+	bool active;
+} dump;
+
 static int
 wg_nl_init(void)
 {
@@ -77,13 +105,14 @@ wg_genl_call(struct nl_msg *msg)
 }
 
 static int
-__wg_linux_init(struct network *net, void *key)
+__wg_linux_init(struct network *net, void *key, bool replace_peers)
 {
 	struct nl_msg *msg;
 
 	msg = wg_genl_msg(net, true);
 	nla_put(msg, WGDEVICE_A_PRIVATE_KEY, WG_KEY_LEN, key);
-	nla_put_u32(msg, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
+	if (replace_peers)
+		nla_put_u32(msg, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
 
 	return wg_genl_call(msg);
 }
@@ -93,7 +122,18 @@ wg_linux_cleanup(struct network *net)
 {
 	uint8_t key[WG_KEY_LEN] = {};
 
-	__wg_linux_init(net, key);
+	if (batch.net == net) {
+		nlmsg_free(batch.req.msg);
+		batch.req.msg = NULL;
+		batch.net = NULL;
+	}
+
+	/* replies of a running dump are discarded */
+	if (dump.net == net)
+		dump.net = NULL;
+	net->wg.refresh_pending = false;
+
+	__wg_linux_init(net, key, true);
 }
 
 static int
@@ -102,7 +142,10 @@ wg_linux_init(struct network *net)
 	if (wg_nl_init())
 		return -1;
 
-	return __wg_linux_init(net, net->config.key);
+	/* flush old peers together with the first batch of new ones */
+	net->wg.replace_peers = true;
+
+	return __wg_linux_init(net, net->config.key, false);
 }
 
 static int
@@ -117,7 +160,8 @@ wg_linux_init_local(struct network *net, struct network_peer *peer)
 }
 
 static void
-wg_linux_msg_add_ip(struct nl_msg *msg, int af, void *addr, int mask)
+wg_linux_msg_add_ip(struct nl_msg *msg, int af, void *addr, int mask,
+		    uint32_t flags)
 {
 	struct nlattr *ip;
 	int len;
@@ -131,120 +175,413 @@ wg_linux_msg_add_ip(struct nl_msg *msg, int af, void *addr, int mask)
 	nla_put_u16(msg, WGALLOWEDIP_A_FAMILY, af);
 	nla_put(msg, WGALLOWEDIP_A_IPADDR, len, addr);
 	nla_put_u8(msg, WGALLOWEDIP_A_CIDR_MASK, mask);
+	if (flags)
+		nla_put_u32(msg, WGALLOWEDIP_A_FLAGS, flags);
 	nla_nest_end(msg, ip);
 }
 
+static struct wg_linux_peer_req *
+wg_linux_peer_req_get(struct network *net, struct wg_linux_peer_req *req)
+{
+	if (batch.net == net)
+		return &batch.req;
+
+	memset(req, 0, sizeof(*req));
+
+	return req;
+}
+
+static void
+wg_linux_peer_req_msg_init(struct network *net, struct wg_linux_peer_req *req)
+{
+	req->msg = wg_genl_msg(net, true);
+	req->replace_peers = net->wg.replace_peers;
+	if (net->wg.replace_peers) {
+		nla_put_u32(req->msg, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
+		net->wg.replace_peers = false;
+	}
+	req->peers = nla_nest_start(req->msg, WGDEVICE_A_PEERS);
+}
+
 static struct nl_msg *
 wg_linux_peer_req_init(struct network *net, struct network_peer *peer,
 		       struct wg_linux_peer_req *req)
 {
-	req->msg = wg_genl_msg(net, true);
+	if (!req->msg)
+		wg_linux_peer_req_msg_init(net, req);
 
-	req->peers = nla_nest_start(req->msg, WGDEVICE_A_PEERS);
+	req->peer = peer;
 	req->entry = nla_nest_start(req->msg, 0);
 	nla_put(req->msg, WGPEER_A_PUBLIC_KEY, WG_KEY_LEN, peer->key);
 
 	return req->msg;
 }
 
+static bool
+wg_linux_peer_req_full(struct wg_linux_peer_req *req)
+{
+	return nlmsg_get_max_size(req->msg) <=
+	       nlmsg_total_size(nlmsg_hdr(req->msg)->nlmsg_len) + 256;
+}
+
+/* confirm or invalidate the AllowedIPs queued for the peer of a request entry */
+static void
+wg_linux_peer_entry_done(struct network *net, struct nlattr *entry, bool success)
+{
+	struct nlattr *tb[__WGPEER_A_LAST];
+	struct network_peer *peer;
+
+	nla_parse_nested(tb, WGPEER_A_MAX, entry, NULL);
+	if (!tb[WGPEER_A_PUBLIC_KEY])
+		return;
+
+	peer = network_peer_find(net, nla_data(tb[WGPEER_A_PUBLIC_KEY]), WG_KEY_LEN);
+	if (peer)
+		wg_peer_allowed_ips_done(peer, success);
+}
+
+/*
+ * The kernel stops processing a request at the first peer that fails, so
+ * the peers of a failed batch are sent again one by one. A peer list
+ * replacement is sent on its own first, so that a bad peer cannot keep
+ * stale peers from being flushed.
+ */
+static int
+wg_linux_peer_req_resend(struct network *net, struct nlattr *peers,
+			 bool replace_peers)
+{
+	struct nlattr *cur, *nest;
+	struct nl_msg *msg;
+	int rem, ret = 0, err;
+
+	if (replace_peers) {
+		msg = wg_genl_msg(net, true);
+		nla_put_u32(msg, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
+		ret = wg_genl_call(msg);
+		if (ret)
+			D_NET(net, "peer list replace failed: %s", strerror(-ret));
+	}
+
+	nla_for_each_nested(cur, peers, rem) {
+		msg = wg_genl_msg(net, true);
+		nest = nla_nest_start(msg, WGDEVICE_A_PEERS);
+		nla_put(msg, cur->nla_type, nla_len(cur), nla_data(cur));
+		nla_nest_end(msg, nest);
+
+		err = wg_genl_call(msg);
+		wg_linux_peer_entry_done(net, cur, !err);
+		if (!err)
+			continue;
+
+		D_NET(net, "peer update failed: %s", strerror(-err));
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+static void
+wg_linux_peer_req_send(struct wg_linux_peer_req *req)
+{
+	struct nl_msg *msg = req->msg;
+	bool is_batch = req == &batch.req;
+	struct nlattr *cur;
+	int rem, ret;
+
+	if (!msg)
+		return;
+
+	req->msg = NULL;
+	nla_nest_end(msg, req->peers);
+
+	/* keep the message around for resending individual peers */
+	if (is_batch)
+		nlmsg_get(msg);
+
+	ret = wg_genl_call(msg);
+	if (is_batch) {
+		if (ret) {
+			D_NET(batch.net, "peer batch update failed: %s", strerror(-ret));
+			ret = wg_linux_peer_req_resend(batch.net, req->peers,
+						       req->replace_peers);
+		} else {
+			nla_for_each_nested(cur, req->peers, rem)
+				wg_linux_peer_entry_done(batch.net, cur, true);
+		}
+		nlmsg_free(msg);
+	} else if (req->peer) {
+		wg_peer_allowed_ips_done(req->peer, !ret);
+	}
+
+	if (ret && !req->ret)
+		req->ret = ret;
+}
+
 static int
 wg_linux_peer_req_done(struct wg_linux_peer_req *req)
 {
 	nla_nest_end(req->msg, req->entry);
-	nla_nest_end(req->msg, req->peers);
 
-	return wg_genl_call(req->msg);
+	if (req == &batch.req) {
+		if (wg_linux_peer_req_full(req))
+			wg_linux_peer_req_send(req);
+
+		return 0;
+	}
+
+	wg_linux_peer_req_send(req);
+
+	return req->ret;
 }
 
 static struct nl_msg *
-wg_linux_peer_msg_size_check(struct wg_linux_peer_req *req, struct network *net,
-			     struct network_peer *peer)
+wg_linux_peer_msg_size_check(struct wg_linux_peer_req *req, struct network *net)
 {
-	if (nlmsg_get_max_size(req->msg) >
-	    nlmsg_total_size(nlmsg_hdr(req->msg)->nlmsg_len) + 256)
+	if (!wg_linux_peer_req_full(req))
 		return req->msg;
 
 	nla_nest_end(req->msg, req->ips);
-	wg_linux_peer_req_done(req);
+	nla_nest_end(req->msg, req->entry);
+	wg_linux_peer_req_send(req);
 
-	wg_linux_peer_req_init(net, peer, req);
+	wg_linux_peer_req_init(net, req->peer, req);
 	req->ips = nla_nest_start(req->msg, WGPEER_A_ALLOWEDIPS);
 
 	return req->msg;
 }
 
+struct wg_linux_ip_ctx {
+	struct wg_linux_peer_req *req;
+	struct network *net;
+	bool add, del;
+};
+
 static void
-wg_linux_peer_msg_add_allowed_ip(struct wg_linux_peer_req *req, struct network *net,
-				 struct network_peer *peer)
+wg_linux_peer_ip_cb(void *ptr, struct network_prefix *p, bool add)
 {
-	struct nl_msg *msg = req->msg;
-	struct blob_attr *cur;
-	int rem;
+	struct wg_linux_ip_ctx *ctx = ptr;
 
-	wg_linux_msg_add_ip(msg, AF_INET6, &peer->local_addr.in6, 128);
-	msg = wg_linux_peer_msg_size_check(req, net, peer);
+	if (!(add ? ctx->add : ctx->del))
+		return;
 
-	blobmsg_for_each_attr(cur, peer->ipaddr, rem) {
-		const char *str = blobmsg_get_string(cur);
-		struct in6_addr in6;
-		int af, mask;
+	wg_linux_msg_add_ip(ctx->req->msg, p->af, &p->addr, p->mask,
+			    add ? 0 : WGALLOWEDIP_F_REMOVE_ME);
+	wg_linux_peer_msg_size_check(ctx->req, ctx->net);
+}
 
-		if (strchr(str, ':')) {
-			af = AF_INET6;
-			mask = 128;
-		} else {
-			af = AF_INET;
-			mask = 32;
-		}
+/*
+ * WGALLOWEDIP_F_REMOVE_ME is only supported on newer kernels, so the first
+ * removal is sent on its own to find out if it is accepted.
+ */
+static int
+wg_linux_peer_remove_ips(struct network *net, struct network_peer *peer,
+			 struct network_prefix *ips, int n_ips)
+{
+	struct wg_linux_peer_req req = {};
+	struct wg_linux_ip_ctx ctx = {
+		.req = &req,
+		.net = net,
+		.del = true,
+	};
+	int removed;
 
-		if (inet_pton(af, str, &in6) != 1)
-			continue;
+	wg_linux_peer_req_init(net, peer, &req);
+	req.ips = nla_nest_start(req.msg, WGPEER_A_ALLOWEDIPS);
+	wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed, wg_linux_peer_ip_cb, &ctx);
+	nla_nest_end(req.msg, req.ips);
+	nla_nest_end(req.msg, req.entry);
+	wg_linux_peer_req_send(&req);
 
-		wg_linux_msg_add_ip(msg, af, &in6, mask);
-		msg = wg_linux_peer_msg_size_check(req, net, peer);
-	}
+	return req.ret;
+}
+
+struct wg_linux_ip_check {
+	const uint8_t *key;
+	struct network_prefix p;
+	bool found;
+};
+
+static void
+wg_linux_ip_check_prefix_cb(void *ptr, struct network_prefix *p, bool add)
+{
+	struct wg_linux_ip_check *chk = ptr;
 
-	blobmsg_for_each_attr(cur, peer->subnet, rem) {
-		const char *str = blobmsg_get_string(cur);
-		union network_addr addr;
-		int mask;
-		int af;
+	if (!add && !chk->p.af)
+		chk->p = *p;
+}
 
-		af = strchr(str, ':') ? AF_INET6 : AF_INET;
-		if (network_get_subnet(af, &addr, &mask, str))
+static int
+wg_linux_ip_check_cb(struct nl_msg *msg, void *arg)
+{
+	struct wg_linux_ip_check *chk = arg;
+	struct nlattr *tb[__WGDEVICE_A_LAST];
+	struct nlattr *ptb[__WGPEER_A_LAST];
+	struct nlattr *atb[__WGALLOWEDIP_A_LAST];
+	struct nlattr *peer, *ip;
+	int rem, rem_ip, len;
+
+	nlmsg_parse(nlmsg_hdr(msg), sizeof(struct genlmsghdr), tb, WGDEVICE_A_MAX, NULL);
+	if (!tb[WGDEVICE_A_PEERS])
+		return NL_SKIP;
+
+	len = chk->p.af == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+	nla_for_each_nested(peer, tb[WGDEVICE_A_PEERS], rem) {
+		nla_parse_nested(ptb, WGPEER_A_MAX, peer, NULL);
+		if (!ptb[WGPEER_A_PUBLIC_KEY] || !ptb[WGPEER_A_ALLOWEDIPS] ||
+		    memcmp(nla_data(ptb[WGPEER_A_PUBLIC_KEY]), chk->key, WG_KEY_LEN) != 0)
 			continue;
 
-		wg_linux_msg_add_ip(msg, af, &addr, mask);
-		msg = wg_linux_peer_msg_size_check(req, net, peer);
+		nla_for_each_nested(ip, ptb[WGPEER_A_ALLOWEDIPS], rem_ip) {
+			nla_parse_nested(atb, WGALLOWEDIP_A_MAX, ip, NULL);
+			if (!atb[WGALLOWEDIP_A_FAMILY] || !atb[WGALLOWEDIP_A_IPADDR] ||
+			    !atb[WGALLOWEDIP_A_CIDR_MASK])
+				continue;
+
+			if (nla_get_u16(atb[WGALLOWEDIP_A_FAMILY]) != chk->p.af ||
+			    nla_get_u8(atb[WGALLOWEDIP_A_CIDR_MASK]) != chk->p.mask ||
+			    nla_len(atb[WGALLOWEDIP_A_IPADDR]) < len ||
+			    memcmp(nla_data(atb[WGALLOWEDIP_A_IPADDR]), &chk->p.addr, len) != 0)
+				continue;
+
+			chk->found = true;
+		}
 	}
+
+	return NL_SKIP;
 }
 
+/*
+ * Kernels that do not know WGALLOWEDIP_A_FLAGS may accept the probe and add
+ * the address instead of removing it. Check the result with a dump: returns
+ * 1 if removal works, 0 if not and a negative error if the dump failed.
+ */
 static int
-wg_linux_peer_update(struct network *net, struct network_peer *peer, enum wg_update_cmd cmd)
+wg_linux_peer_remove_check(struct network *net, struct network_peer *peer,
+			   struct network_prefix *ips, int n_ips)
 {
-	struct wg_linux_peer_req req;
-	struct network_host *host;
+	struct wg_linux_ip_check chk = {
+		.key = peer->key,
+	};
+	int removed, ret;
 
-	wg_linux_peer_req_init(net, peer, &req);
+	wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed,
+				 wg_linux_ip_check_prefix_cb, &chk);
+
+	ret = wg_linux_peer_remove_ips(net, peer, ips, n_ips);
+	if (ret == -EINVAL || ret == -EOPNOTSUPP)
+		return 0;
+	if (ret)
+		return ret;
+
+	ret = unl_request(&unl, wg_genl_msg(net, false), wg_linux_ip_check_cb, &chk);
+	if (ret)
+		return ret;
+
+	return !chk.found;
+}
+
+static int
+wg_linux_peer_update(struct network *net, struct network_peer *peer, enum wg_update_cmd cmd)
+{
+	struct wg_linux_peer_req _req, *req;
+	struct network_prefix *ips;
+	struct wg_linux_ip_ctx ctx = {
+		.net = net,
+		.add = true,
+		.del = true,
+	};
+	bool replace = cmd == WG_PEER_CREATE;
+	int i, n_ips, removed, ret;
 
 	if (cmd == WG_PEER_DELETE) {
-		nla_put_u32(req.msg, WGPEER_A_FLAGS, WGPEER_F_REMOVE_ME);
-		goto out;
+		req = wg_linux_peer_req_get(net, &_req);
+		wg_linux_peer_req_init(net, peer, req);
+		nla_put_u32(req->msg, WGPEER_A_FLAGS, WGPEER_F_REMOVE_ME);
+		return wg_linux_peer_req_done(req);
 	}
 
-	nla_put_u32(req.msg, WGPEER_A_FLAGS, WGPEER_F_REPLACE_ALLOWEDIPS);
+	/* an earlier request failed, the kernel state is unknown */
+	if (peer->state.wg_ips_replace) {
+		peer->state.wg_ips_replace = false;
+		replace = true;
+	}
 
-	req.ips = nla_nest_start(req.msg, WGPEER_A_ALLOWEDIPS);
+	n_ips = wg_peer_allowed_ips(net, peer, &ips);
+	if (!wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed, NULL, NULL) &&
+	    !replace) {
+		free(ips);
+		return 0;
+	}
 
-	wg_linux_peer_msg_add_allowed_ip(&req, net, peer);
+	if (removed && !replace) {
+		if (!net->wg.remove_checked && !net->wg.replace_peers) {
+			/* must not overtake requests already queued for this peer */
+			if (batch.net == net)
+				wg_linux_peer_req_send(&batch.req);
 
-	for_each_routed_host(host, net, peer)
-		wg_linux_peer_msg_add_allowed_ip(&req, net, &host->peer);
+			ret = wg_linux_peer_remove_check(net, peer, ips, n_ips);
+			if (ret >= 0) {
+				net->wg.remove_checked = true;
+				net->wg.remove_supported = ret;
+			}
 
-	nla_nest_end(req.msg, req.ips);
+			ctx.del = false;
+			replace = ret <= 0;
+		} else {
+			replace = !net->wg.remove_supported;
+		}
+	}
+
+	req = wg_linux_peer_req_get(net, &_req);
+	wg_linux_peer_req_init(net, peer, req);
+	ctx.req = req;
+
+	if (replace)
+		nla_put_u32(req->msg, WGPEER_A_FLAGS, WGPEER_F_REPLACE_ALLOWEDIPS);
+
+	req->ips = nla_nest_start(req->msg, WGPEER_A_ALLOWEDIPS);
+	if (replace) {
+		for (i = 0; i < n_ips; i++)
+			wg_linux_peer_ip_cb(&ctx, &ips[i], true);
+	} else {
+		wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed,
+					 wg_linux_peer_ip_cb, &ctx);
+	}
+	nla_nest_end(req->msg, req->ips);
+
+	/* recorded once the kernel has accepted the request */
+	wg_peer_set_allowed_ips_pending(peer, ips, n_ips);
+
+	return wg_linux_peer_req_done(req);
+}
+
+static void
+wg_linux_batch_start(struct network *net)
+{
+	if (batch.net)
+		wg_linux_peer_req_send(&batch.req);
+
+	memset(&batch.req, 0, sizeof(batch.req));
+	batch.net = net;
+}
+
+static int
+wg_linux_batch_done(struct network *net)
+{
+	struct wg_linux_peer_req *req = &batch.req;
+
+	if (batch.net != net)
+		return 0;
+
+	/* make sure that a pending peer list replacement is not lost */
+	if (!req->msg && net->wg.replace_peers)
+		wg_linux_peer_req_msg_init(net, req);
 
-out:
-	return wg_linux_peer_req_done(&req);
+	wg_linux_peer_req_send(req);
+	batch.net = NULL;
+
+	return req->ret;
 }
 
 static void
@@ -295,43 +632,188 @@ wg_linux_parse_peer_list(struct network *net, struct nlattr *data, time_t now)
 		wg_linux_parse_peer(net, cur, now);
 }
 
+static int wg_linux_dump_start(struct network *net)
+{
+	struct nl_msg *msg;
+	int ret;
+
+	msg = unl_genl_msg(&dump.unl, WG_CMD_GET_DEVICE, true);
+	nla_put_string(msg, WGDEVICE_A_IFNAME, network_name(net));
+
+	ret = nl_send_auto_complete(dump.unl.sock, msg);
+	dump.seq = nlmsg_hdr(msg)->nlmsg_seq;
+	nlmsg_free(msg);
+
+	if (ret < 0)
+		return -EIO;
+
+	dump.net = net;
+	dump.active = true;
+	uloop_timeout_set(&dump.timeout, WG_LINUX_DUMP_TIMEOUT);
+	wg_peer_refresh_start(net);
+
+	return 0;
+}
+
+static void wg_linux_dump_done(void)
+{
+	struct network *net = dump.net;
+
+	dump.net = NULL;
+	dump.active = false;
+	uloop_timeout_cancel(&dump.timeout);
+
+	if (net)
+		wg_peer_refresh_done(net);
+
+	avl_for_each_element(&networks, net, node) {
+		if (!net->wg.refresh_pending)
+			continue;
+
+		net->wg.refresh_pending = false;
+		if (!wg_linux_dump_start(net))
+			break;
+	}
+}
+
+static int
+wg_linux_dump_seq_check(struct nl_msg *msg, void *arg)
+{
+	/* skip leftovers of an earlier or aborted dump */
+	if (!dump.active || nlmsg_hdr(msg)->nlmsg_seq != dump.seq)
+		return NL_SKIP;
+
+	return NL_OK;
+}
+
 static int
-wg_linux_get_cb(struct nl_msg *msg, void *arg)
+wg_linux_dump_valid(struct nl_msg *msg, void *arg)
 {
 	struct nlmsghdr *nh = nlmsg_hdr(msg);
-	struct network *net = arg;
+	struct network *net = dump.net;
 	struct nlattr *tb[__WGDEVICE_A_LAST];
 	time_t now = time(NULL);
 
+	if (!net)
+		return NL_SKIP;
+
 	nlmsg_parse(nh, sizeof(struct genlmsghdr), tb, __WGDEVICE_A_LAST, NULL);
 	wg_linux_parse_peer_list(net, tb[WGDEVICE_A_PEERS], now);
 
 	return NL_SKIP;
 }
 
+static int
+wg_linux_dump_finish(struct nl_msg *msg, void *arg)
+{
+	wg_linux_dump_done();
+
+	return NL_STOP;
+}
+
+static int
+wg_linux_dump_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	if (err->msg.nlmsg_seq != dump.seq)
+		return NL_SKIP;
+
+	if (dump.net)
+		D_NET(dump.net, "peer dump failed: %s", strerror(-err->error));
+	wg_linux_dump_done();
+
+	return NL_STOP;
+}
+
+static void
+wg_linux_dump_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	int ret;
+
+	ret = nl_recvmsgs(dump.unl.sock, dump.cb);
+	if (ret >= 0 || ret == -NLE_AGAIN || !dump.active)
+		return;
+
+	if (dump.net)
+		D_NET(dump.net, "peer dump failed: %s", nl_geterror(ret));
+	wg_linux_dump_done();
+}
+
+static void
+wg_linux_dump_timeout_cb(struct uloop_timeout *t)
+{
+	/* the reply got lost, don't let it block refreshes of all networks */
+	if (dump.net)
+		D_NET(dump.net, "peer dump timed out");
+	wg_linux_dump_done();
+}
+
+static int
+wg_linux_dump_init(void)
+{
+	int ret;
+
+	if (dump.cb)
+		return 0;
+
+	ret = unl_genl_init(&dump.unl, "wireguard");
+	if (ret)
+		return ret;
+
+	dump.cb = nl_cb_alloc(NL_CB_CUSTOM);
+	if (!dump.cb) {
+		unl_free(&dump.unl);
+		return -1;
+	}
+
+	nl_socket_set_buffer_size(dump.unl.sock, 32768, 262144);
+	nl_socket_set_nonblocking(dump.unl.sock);
+	nl_cb_set(dump.cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, wg_linux_dump_seq_check, NULL);
+	nl_cb_set(dump.cb, NL_CB_VALID, NL_CB_CUSTOM, wg_linux_dump_valid, NULL);
+	nl_cb_set(dump.cb, NL_CB_FINISH, NL_CB_CUSTOM, wg_linux_dump_finish, NULL);
+	nl_cb_err(dump.cb, NL_CB_CUSTOM, wg_linux_dump_error, NULL);
+
+	dump.fd.fd = nl_socket_get_fd(dump.unl.sock);
+	dump.fd.cb = wg_linux_dump_fd_cb;
+	uloop_fd_add(&dump.fd, ULOOP_READ);
+	dump.timeout.cb = wg_linux_dump_timeout_cb;
+
+	return 0;
+}
+
 static int
 wg_linux_peer_refresh(struct network *net)
 {
-	struct nl_msg *msg = wg_genl_msg(net, false);
+	if (wg_linux_dump_init())
+		return -1;
+
+	/* previous dump still in progress */
+	if (dump.net == net)
+		return 0;
 
-	return unl_request(&unl, msg, wg_linux_get_cb, net);
+	if (dump.active) {
+		net->wg.refresh_pending = true;
+		return 0;
+	}
+
+	return wg_linux_dump_start(net);
 }
 
 static int
 wg_linux_peer_connect(struct network *net, struct network_peer *peer,
 		      union network_endpoint *ep)
 {
-	struct wg_linux_peer_req req;
+	struct wg_linux_peer_req _req, *req;
 	struct nl_msg *msg;
 	int len;
 
-	msg = wg_linux_peer_req_init(net, peer, &req);
+	req = wg_linux_peer_req_get(net, &_req);
+	msg = wg_linux_peer_req_init(net, peer, req);
 
 	if (net->net_config.keepalive) {
 		nla_put_u16(msg, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, 0);
-		wg_linux_peer_req_done(&req);
+		wg_linux_peer_req_done(req);
 
-		msg = wg_linux_peer_req_init(net, peer, &req);
+		msg = wg_linux_peer_req_init(net, peer, req);
 		nla_put_u16(msg, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL,
 			    net->net_config.keepalive);
 	}
@@ -342,7 +824,7 @@ wg_linux_peer_connect(struct network *net, struct network_peer *peer,
 		len = sizeof(ep->in);
 	nla_put(msg, WGPEER_A_ENDPOINT, len, &ep->in6);
 
-	return wg_linux_peer_req_done(&req);
+	return wg_linux_peer_req_done(req);
 }
 
 const struct wg_ops wg_linux_ops = {
@@ -353,4 +835,6 @@ const struct wg_ops wg_linux_ops = {
 	.peer_update = wg_linux_peer_update,
 	.peer_refresh = wg_linux_peer_refresh,
 	.peer_connect = wg_linux_peer_connect,
+	.batch_start = wg_linux_batch_start,
+	.batch_done = wg_linux_batch_done,
 };
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -31,9 +32,43 @@ struct wg_req {
 	char *buf;
 	size_t buf_len;
 
-	char *key, *value;
+	/* peers touched by this request */
+	uint8_t (*keys)[WG_KEY_LEN];
+	int n_keys;
+};
 
-	int ret;
+/* request sent to the daemon, replies arrive in the same order */
+struct wg_user_txn {
+	struct list_head list;
+
+	uint8_t (*keys)[WG_KEY_LEN];
+	int n_keys;
+};
+
+struct wg_user_conn {
+	struct uloop_fd fd;
+	struct network *net;
+
+	char rbuf[4096];
+	size_t rbuf_len;
+
+	char *wbuf;
+	size_t wbuf_len;
+
+	/* set=1 transaction collecting peer updates while batching */
+	struct wg_req batch;
+	bool batch_active;
+
+	/* replies still outstanding */
+	struct list_head txns;
+	int pending;
+	bool get_pending;
+	int reply_err;
+
+	/* get reply parser state */
+	struct network_peer *peer;
+	uint8_t key[WG_KEY_LEN];
+	time_t now;
 };
 
 static void
@@ -106,127 +141,439 @@ static bool wg_user_check(struct network *net)
 	return true;
 }
 
-static FILE *wg_user_file(struct network *net)
+static int wg_user_socket(struct network *net)
 {
 	struct stat sbuf;
 	struct sockaddr_un addr = { .sun_family = AF_UNIX };
-	int fd = -1, ret;
-	FILE *f = NULL;
+	int fd, ret;
 
-	errno = EINVAL;
 	ret = snprintf(addr.sun_path, sizeof(addr.sun_path), SOCK_PATH "%s" SOCK_SUFFIX, network_name(net));
 	if (ret < 0)
-		goto out;
-	ret = stat(addr.sun_path, &sbuf);
-	if (ret < 0)
-		goto out;
-	errno = EBADF;
+		return -EINVAL;
+	if (stat(addr.sun_path, &sbuf) < 0)
+		return -errno;
 	if (!S_ISSOCK(sbuf.st_mode))
-		goto out;
+		return -EBADF;
 
-	ret = fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (ret < 0)
-		goto out;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
 
-	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0) {
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
 		if (errno == ECONNREFUSED) /* If the process is gone, we try to clean up the socket. */
 			unlink(addr.sun_path);
-		goto out;
+		close(fd);
+		return ret;
 	}
-	f = fdopen(fd, "r+");
-	if (f)
-		errno = 0;
-out:
-	ret = -errno;
-	if (ret) {
-		if (fd >= 0)
-			close(fd);
-		errno = -ret;
-		return NULL;
+
+	return fd;
+}
+
+/*
+ * Confirm or invalidate the AllowedIPs queued for the peers of a request.
+ * An error can not be tied to a single peer, so all of them are affected.
+ */
+static void
+wg_user_keys_done(struct network *net, uint8_t (*keys)[WG_KEY_LEN], int n_keys,
+		  bool success)
+{
+	struct network_peer *peer;
+	int i;
+
+	for (i = 0; i < n_keys; i++) {
+		peer = network_peer_find(net, keys[i], WG_KEY_LEN);
+		if (peer)
+			wg_peer_allowed_ips_done(peer, success);
 	}
-	return f;
+
+	free(keys);
 }
 
-static void wg_req_set(struct wg_req *req, const char *key, const char *value)
+static void
+wg_user_txn_add(struct wg_user_conn *conn, uint8_t (*keys)[WG_KEY_LEN], int n_keys)
 {
-	fprintf(req->f, "%s=%s\n", key, value);
+	struct wg_user_txn *txn;
+
+	txn = calloc(1, sizeof(*txn));
+	txn->keys = keys;
+	txn->n_keys = n_keys;
+	list_add_tail(&txn->list, &conn->txns);
+	conn->pending++;
 }
 
-static void wg_req_set_int(struct wg_req *req, const char *key, int value)
+static void
+wg_user_txn_done(struct wg_user_conn *conn, bool success)
 {
-	fprintf(req->f, "%s=%d\n", key, value);
+	struct wg_user_txn *txn;
+
+	if (list_empty(&conn->txns))
+		return;
+
+	txn = list_first_entry(&conn->txns, struct wg_user_txn, list);
+	list_del(&txn->list);
+	wg_user_keys_done(conn->net, txn->keys, txn->n_keys, success);
+	free(txn);
 }
 
-#define wg_req_printf(req, name, format, ...) fprintf((req)->f, "%s=" format "\n", name, ##__VA_ARGS__)
+static void wg_user_conn_free(struct wg_user_conn *conn)
+{
+	conn->net->wg.user = NULL;
+	uloop_fd_delete(&conn->fd);
+	close(conn->fd.fd);
+
+	/* unanswered requests may or may not have been applied */
+	while (!list_empty(&conn->txns))
+		wg_user_txn_done(conn, false);
+	wg_user_keys_done(conn->net, conn->batch.keys, conn->batch.n_keys, false);
+
+	if (conn->batch.f)
+		fclose(conn->batch.f);
+	free(conn->batch.buf);
+	free(conn->wbuf);
+	free(conn);
+}
 
-static int wg_req_init(struct wg_req *req, struct network *net, bool set)
+static int wg_user_conn_write_pending(struct wg_user_conn *conn)
 {
-	memset(req, 0, sizeof(*req));
-	req->ret = -1;
-	req->f = wg_user_file(net);
-	if (!req->f)
-		return -1;
+	ssize_t len;
+
+	while (conn->wbuf_len > 0) {
+		len = write(conn->fd.fd, conn->wbuf, conn->wbuf_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+
+		conn->wbuf_len -= len;
+		memmove(conn->wbuf, conn->wbuf + len, conn->wbuf_len);
+	}
+
+	return 0;
+}
+
+static int wg_user_conn_flush(struct wg_user_conn *conn)
+{
+	int ret;
 
-	wg_req_set(req, set ? "set" : "get", "1");
+	ret = wg_user_conn_write_pending(conn);
+	if (ret)
+		return ret;
+
+	if (!conn->wbuf_len != !(conn->fd.flags & ULOOP_WRITE))
+		uloop_fd_add(&conn->fd, ULOOP_READ | (conn->wbuf_len ? ULOOP_WRITE : 0));
 
 	return 0;
 }
 
-static bool wg_req_fetch(struct wg_req *req)
+static int
+wg_user_conn_write(struct wg_user_conn *conn, const char *data, size_t len)
 {
-	int len;
+	int ret;
+
+	conn->wbuf = realloc(conn->wbuf, conn->wbuf_len + len);
+	memcpy(conn->wbuf + conn->wbuf_len, data, len);
+	conn->wbuf_len += len;
 
-	if (!req->buf) {
-		fprintf(req->f, "\n");
-		fflush(req->f);
+	ret = wg_user_conn_flush(conn);
+	if (ret) {
+		fprintf(stderr, "Lost connection to wireguard daemon on network %s: %s\n",
+			network_name(conn->net), strerror(-ret));
+		wg_user_conn_free(conn);
 	}
 
-	if (getline(&req->buf, &req->buf_len, req->f) <= 0)
-		return false;
+	return ret;
+}
 
-	req->key = req->buf;
-	len = strlen(req->key);
-	if (len == 1 && req->key[0] == '\n')
-		return false;
+static struct network_peer *
+wg_user_conn_peer(struct wg_user_conn *conn)
+{
+	struct network_peer *peer;
 
-	req->value = strchr(req->key, '=');
-	if (!req->value || !len || req->key[len - 1] != '\n')
-		return false;
+	peer = network_peer_find(conn->net, conn->key, WG_KEY_LEN);
+	if (!peer || peer->indirect)
+		return NULL;
 
-	*(req->value++) = req->key[--len] = 0;
-	if (!strcmp(req->key, "errno"))
-		req->ret = atoi(req->value);
+	return peer;
+}
 
-	return true;
+static void
+wg_user_parse_endpoint(struct network *net, struct network_peer *peer, char *value)
+{
+	struct addrinfo *resolved;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_protocol = IPPROTO_UDP,
+	};
+	char *port;
+
+	if (!strlen(value))
+		return;
+
+	if (value[0] == '[') {
+		value++;
+		port = strchr(value, ']');
+		if (!port)
+			return;
+
+		*port++ = 0;
+		if (*port++ != ':')
+			return;
+	} else {
+		port = strchr(value, ':');
+		if (!port)
+			return;
+
+		*port++ = 0;
+	}
+
+	if (!*port)
+		return;
+
+	if (getaddrinfo(value, port, &hints, &resolved) != 0)
+		return;
+
+	if ((resolved->ai_family == AF_INET && resolved->ai_addrlen == sizeof(struct sockaddr_in)) ||
+	    (resolved->ai_family == AF_INET6 && resolved->ai_addrlen == sizeof(struct sockaddr_in6)))
+		wg_peer_set_endpoint(net, peer, resolved->ai_addr, resolved->ai_addrlen);
+
+	freeaddrinfo(resolved);
 }
 
-static void wg_req_complete(struct wg_req *req)
+static void
+wg_user_parse_line(struct wg_user_conn *conn, char *key)
 {
-	while (wg_req_fetch(req));
+	struct network *net = conn->net;
+	struct network_peer *peer = conn->peer;
+	char *value;
+	int err;
+
+	if (!*key) {
+		/* end of reply */
+		if (peer)
+			wg_peer_update_done(net, peer);
+		conn->peer = NULL;
+
+		wg_user_txn_done(conn, !conn->reply_err);
+		conn->reply_err = 0;
+
+		if (conn->pending > 0 && !--conn->pending && conn->get_pending) {
+			conn->get_pending = false;
+			wg_peer_refresh_done(net);
+		}
+		return;
+	}
+
+	value = strchr(key, '=');
+	if (!value)
+		return;
+
+	*(value++) = 0;
+
+	if (!strcmp(key, "errno")) {
+		err = atoi(value);
+		conn->reply_err = err;
+		if (err)
+			fprintf(stderr, "Wireguard request failed on network %s: %s\n",
+				network_name(net), strerror(err));
+		return;
+	}
+
+	if (!strcmp(key, "public_key")) {
+		if (peer)
+			wg_peer_update_done(net, peer);
+		if (key_from_hex(conn->key, value))
+			conn->peer = wg_peer_update_start(net, conn->key);
+		else
+			conn->peer = NULL;
+		return;
+	}
+
+	if (!peer)
+		return;
+
+	if (!strcmp(key, "last_handshake_time_sec")) {
+		uint64_t sec = strtoull(value, NULL, 0);
+
+		wg_peer_set_last_handshake(net, peer, conn->now, sec);
+		return;
+	}
+
+	if (!strcmp(key, "rx_bytes")) {
+		uint64_t bytes = strtoull(value, NULL, 0);
+
+		wg_peer_set_rx_bytes(net, peer, bytes);
+		return;
+	}
+
+	if (!strcmp(key, "tx_bytes")) {
+		uint64_t bytes = strtoull(value, NULL, 0);
+
+		wg_peer_set_tx_bytes(net, peer, bytes);
+		return;
+	}
+
+	if (!strcmp(key, "endpoint"))
+		wg_user_parse_endpoint(net, peer, value);
 }
 
-static int wg_req_done(struct wg_req *req)
+static void
+wg_user_fd_cb(struct uloop_fd *fd, unsigned int events)
 {
-	if (!req->buf)
-		wg_req_complete(req);
+	struct wg_user_conn *conn = container_of(fd, struct wg_user_conn, fd);
+	char *line, *sep, *end;
+	ssize_t len;
+
+	if ((events & ULOOP_WRITE) && wg_user_conn_flush(conn))
+		goto error;
+
+	/* peers may have changed since the last partial reply was parsed */
+	if (conn->peer)
+		conn->peer = wg_user_conn_peer(conn);
+
+	while (1) {
+		len = read(fd->fd, conn->rbuf + conn->rbuf_len,
+			   sizeof(conn->rbuf) - conn->rbuf_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			goto error;
+		}
+
+		if (!len)
+			goto error;
+
+		line = conn->rbuf;
+		end = line + conn->rbuf_len + len;
+		while ((sep = memchr(line, '\n', end - line)) != NULL) {
+			*sep = 0;
+			wg_user_parse_line(conn, line);
+			line = sep + 1;
+		}
 
-	if (req->f)
-		fclose(req->f);
-	free(req->buf);
+		conn->rbuf_len = end - line;
+		if (conn->rbuf_len == sizeof(conn->rbuf))
+			goto error;
 
-	return -req->ret;
+		memmove(conn->rbuf, line, conn->rbuf_len);
+	}
+
+	return;
+
+error:
+	fprintf(stderr, "Lost connection to wireguard daemon on network %s\n",
+		network_name(conn->net));
+	wg_user_conn_free(conn);
 }
 
-static int
-wg_user_test(struct network *net)
+static struct wg_user_conn *wg_user_conn_get(struct network *net)
 {
-	struct wg_req req;
+	struct wg_user_conn *conn = net->wg.user;
+	int fd;
+
+	if (conn)
+		return conn;
+
+	fd = wg_user_socket(net);
+	if (fd < 0)
+		return NULL;
 
-	if (wg_req_init(&req, net, false))
+	/* replies are drained until EAGAIN, never block the main loop */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	conn->net = net;
+	conn->fd.fd = fd;
+	conn->fd.cb = wg_user_fd_cb;
+	INIT_LIST_HEAD(&conn->txns);
+	uloop_fd_add(&conn->fd, ULOOP_READ);
+	net->wg.user = conn;
+
+	return conn;
+}
+
+static void wg_req_set(struct wg_req *req, const char *key, const char *value)
+{
+	fprintf(req->f, "%s=%s\n", key, value);
+}
+
+static void wg_req_set_int(struct wg_req *req, const char *key, int value)
+{
+	fprintf(req->f, "%s=%d\n", key, value);
+}
+
+#define wg_req_printf(req, name, format, ...) fprintf((req)->f, "%s=" format "\n", name, ##__VA_ARGS__)
+
+static int wg_req_init(struct wg_req *req, struct network *net)
+{
+	memset(req, 0, sizeof(*req));
+	req->f = open_memstream(&req->buf, &req->buf_len);
+	if (!req->f)
 		return -1;
 
-	return wg_req_done(&req);
+	wg_req_set(req, "set", "1");
+
+	if (net->wg.replace_peers) {
+		wg_req_set(req, "replace_peers", "true");
+		net->wg.replace_peers = false;
+	}
+
+	return 0;
+}
+
+static int wg_req_done(struct wg_req *req, struct network *net)
+{
+	struct wg_user_conn *conn;
+	uint8_t (*keys)[WG_KEY_LEN];
+	int n_keys;
+	size_t len;
+	char *buf;
+	int ret = -ENOTCONN;
+
+	fputc('\n', req->f);
+	fclose(req->f);
+	req->f = NULL;
+
+	/* req may be part of conn, which is freed on write errors */
+	buf = req->buf;
+	len = req->buf_len;
+	req->buf = NULL;
+	keys = req->keys;
+	n_keys = req->n_keys;
+	req->keys = NULL;
+	req->n_keys = 0;
+
+	conn = wg_user_conn_get(net);
+	if (conn) {
+		wg_user_txn_add(conn, keys, n_keys);
+		ret = wg_user_conn_write(conn, buf, len);
+	} else {
+		wg_user_keys_done(net, keys, n_keys, false);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int
+wg_user_batch_flush(struct network *net)
+{
+	struct wg_user_conn *conn = net->wg.user;
+
+	if (!conn || !conn->batch.f)
+		return 0;
+
+	return wg_req_done(&conn->batch, net);
 }
 
 static int
@@ -235,15 +582,15 @@ wg_network_reset(struct network *net, uint8_t *key)
 	struct wg_req req;
 	char key_str[WG_KEY_LEN_HEX];
 
-	if (wg_req_init(&req, net, true))
-		return -1;
+	wg_user_batch_flush(net);
 
-	wg_req_set(&req, "replace_peers", "true");
+	if (wg_req_init(&req, net))
+		return -1;
 
 	key_to_hex(key_str, key);
 	wg_req_set(&req, "private_key", key_str);
 
-	return wg_req_done(&req);
+	return wg_req_done(&req, net);
 }
 
 static int
@@ -251,19 +598,37 @@ wg_user_init(struct network *net)
 {
 	int err;
 
-	err = wg_user_test(net);
+	if (!wg_user_conn_get(net))
+		return -1;
+
+	err = wg_network_reset(net, net->config.key);
 	if (err)
 		return err;
 
-	return wg_network_reset(net, net->config.key);
+	/* stale peers are flushed along with the first peer update */
+	net->wg.replace_peers = true;
+
+	return 0;
 }
 
 static void
 wg_user_cleanup(struct network *net)
 {
+	struct wg_user_conn *conn;
 	uint8_t key[WG_KEY_LEN] = {};
 
+	net->wg.replace_peers = true;
 	wg_network_reset(net, key);
+
+	conn = net->wg.user;
+	if (!conn)
+		return;
+
+	/* make sure the reset reaches the daemon before closing */
+	uloop_fd_delete(&conn->fd);
+	fcntl(conn->fd.fd, F_SETFL, fcntl(conn->fd.fd, F_GETFL) & ~O_NONBLOCK);
+	wg_user_conn_write_pending(conn);
+	wg_user_conn_free(conn);
 }
 
 static int
@@ -271,198 +636,147 @@ wg_user_init_local(struct network *net, struct network_peer *peer)
 {
 	struct wg_req req;
 
-	if (wg_req_init(&req, net, true))
+	wg_user_batch_flush(net);
+
+	if (wg_req_init(&req, net))
 		return -1;
 
 	wg_req_set_int(&req, "listen_port", peer ? peer->port : 0);
 
-	return wg_req_done(&req);
+	return wg_req_done(&req, net);
 }
 
-static void
-wg_user_peer_req_add_allowed_ip(struct wg_req *req, struct network_peer *peer)
+static struct wg_req *
+wg_user_peer_req_init(struct network *net, struct wg_req *req,
+		      struct network_peer *peer)
 {
-	char addr[INET6_ADDRSTRLEN];
-	struct blob_attr *cur;
-	int rem;
-
-	inet_ntop(AF_INET6, &peer->local_addr.in6, addr, sizeof(addr));
-	wg_req_printf(req, "allowed_ip", "%s/128", addr);
-
-	blobmsg_for_each_attr(cur, peer->ipaddr, rem) {
-		const char *str = blobmsg_get_string(cur);
-		struct in6_addr in6;
-		int af, mask;
-
-		if (strchr(str, ':')) {
-			af = AF_INET6;
-			mask = 128;
-		} else {
-			af = AF_INET;
-			mask = 32;
-		}
+	struct wg_user_conn *conn = net->wg.user;
+	char key[WG_KEY_LEN_HEX];
 
-		if (inet_pton(af, str, &in6) != 1)
-			continue;
+	if (conn && conn->batch_active)
+		req = &conn->batch;
 
-		wg_req_printf(req, "allowed_ip", "%s/%d", str, mask);
-	}
+	if (!req->f && wg_req_init(req, net))
+		return NULL;
 
-	blobmsg_for_each_attr(cur, peer->subnet, rem) {
-		const char *str = blobmsg_get_string(cur);
-		char buf[INET6_ADDRSTRLEN];
-		union network_addr addr;
-		int mask;
-		int af;
+	key_to_hex(key, peer->key);
+	wg_req_set(req, "public_key", key);
 
-		af = strchr(str, ':') ? AF_INET6 : AF_INET;
-		if (network_get_subnet(af, &addr, &mask, str))
-			continue;
+	req->keys = realloc(req->keys, (req->n_keys + 1) * sizeof(*req->keys));
+	memcpy(req->keys[req->n_keys++], peer->key, WG_KEY_LEN);
 
-		inet_ntop(af, &addr, buf, sizeof(buf));
-		wg_req_printf(req, "allowed_ip", "%s/%d", buf, mask);
-	}
+	return req;
 }
 
 static int
-wg_user_peer_update(struct network *net, struct network_peer *peer, enum wg_update_cmd cmd)
+wg_user_peer_req_done(struct network *net, struct wg_req *req)
 {
-	struct network_host *host;
-	struct wg_req req;
-	char key[WG_KEY_LEN_HEX];
+	struct wg_user_conn *conn = net->wg.user;
 
-	if (wg_req_init(&req, net, true))
-		return -1;
+	if (conn && req == &conn->batch)
+		return 0;
 
-	key_to_hex(key, peer->key);
-	wg_req_set(&req, "public_key", key);
+	return wg_req_done(req, net);
+}
 
-	if (cmd == WG_PEER_DELETE) {
-		wg_req_set(&req, "remove", "true");
-		goto out;
-	}
+static void
+wg_user_peer_req_add_ip(void *ctx, struct network_prefix *p, bool add)
+{
+	struct wg_req *req = ctx;
+	char buf[INET6_ADDRSTRLEN];
 
-	wg_req_set(&req, "replace_allowed_ips", "true");
-	wg_user_peer_req_add_allowed_ip(&req, peer);
-	for_each_routed_host(host, net, peer)
-		wg_user_peer_req_add_allowed_ip(&req, &host->peer);
+	if (!add)
+		return;
 
-out:
-	return wg_req_done(&req);
+	inet_ntop(p->af, &p->addr, buf, sizeof(buf));
+	wg_req_printf(req, "allowed_ip", "%s/%d", buf, p->mask);
 }
 
 static int
-wg_user_peer_refresh(struct network *net)
+wg_user_peer_update(struct network *net, struct network_peer *peer, enum wg_update_cmd cmd)
 {
-	struct network_peer *peer = NULL;
-	struct wg_req req;
-	uint8_t key[WG_KEY_LEN];
-	time_t now = time(NULL);
-
-	if (wg_req_init(&req, net, false))
-		return -1;
-
-	while (wg_req_fetch(&req)) {
-		if (!strcmp(req.key, "public_key")) {
-			if (peer)
-				wg_peer_update_done(net, peer);
-			if (key_from_hex(key, req.value))
-				peer = wg_peer_update_start(net, key);
-			else
-				peer = NULL;
-			continue;
-		}
-
-		if (!peer)
-			continue;
-
-		if (!strcmp(req.key, "last_handshake_time_sec")) {
-			uint64_t sec = strtoull(req.value, NULL, 0);
-
-			wg_peer_set_last_handshake(net, peer, now, sec);
-			continue;
+	struct network_prefix *ips = NULL;
+	struct wg_req _req = {}, *req;
+	bool replace = cmd == WG_PEER_CREATE;
+	int i, n_ips = 0, removed = 0;
+
+	if (cmd != WG_PEER_DELETE) {
+		/* an earlier request failed, the daemon state is unknown */
+		if (peer->state.wg_ips_replace)
+			replace = true;
+
+		n_ips = wg_peer_allowed_ips(net, peer, &ips);
+		if (!wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed, NULL, NULL) &&
+		    !replace) {
+			free(ips);
+			return 0;
 		}
+	}
 
-		if (!strcmp(req.key, "rx_bytes")) {
-			uint64_t bytes = strtoull(req.value, NULL, 0);
-
-			wg_peer_set_rx_bytes(net, peer, bytes);
-			continue;
-		}
-
-		if (!strcmp(req.key, "tx_bytes")) {
-			uint64_t bytes = strtoull(req.value, NULL, 0);
-
-			wg_peer_set_tx_bytes(net, peer, bytes);
-			continue;
-		}
-
-		if (!strcmp(req.key, "endpoint")) {
-			struct addrinfo *resolved;
-			struct addrinfo hints = {
-				.ai_family = AF_UNSPEC,
-				.ai_socktype = SOCK_DGRAM,
-				.ai_protocol = IPPROTO_UDP,
-			};
-			char *port;
-
-			if (!strlen(req.value))
-				continue;
+	req = wg_user_peer_req_init(net, &_req, peer);
+	if (!req) {
+		free(ips);
+		return -1;
+	}
 
-			if (req.value[0] == '[') {
-				req.value++;
-				port = strchr(req.value, ']');
-				if (!port)
-					continue;
+	if (cmd == WG_PEER_DELETE) {
+		wg_req_set(req, "remove", "true");
+		goto out;
+	}
 
-				*port++ = 0;
-				if (*port++ != ':')
-					continue;
-			} else {
-				port = strchr(req.value, ':');
-				if (!port)
-					continue;
+	/* the UAPI has no way to remove a single AllowedIP */
+	if (removed || replace) {
+		peer->state.wg_ips_replace = false;
+		wg_req_set(req, "replace_allowed_ips", "true");
+		for (i = 0; i < n_ips; i++)
+			wg_user_peer_req_add_ip(req, &ips[i], true);
+	} else {
+		wg_peer_allowed_ips_diff(peer, ips, n_ips, &removed,
+					 wg_user_peer_req_add_ip, req);
+	}
 
-				*port++ = 0;
-			}
+	/* recorded once the daemon has replied without an error */
+	wg_peer_set_allowed_ips_pending(peer, ips, n_ips);
 
-			if (!*port)
-				continue;
+out:
+	return wg_user_peer_req_done(net, req);
+}
 
-			if (getaddrinfo(req.value, port, &hints, &resolved) != 0)
-				continue;
+static int
+wg_user_peer_refresh(struct network *net)
+{
+	static const char req[] = "get=1\n\n";
+	struct wg_user_conn *conn;
 
-			if ((resolved->ai_family == AF_INET && resolved->ai_addrlen == sizeof(struct sockaddr_in)) ||
-			    (resolved->ai_family == AF_INET6 && resolved->ai_addrlen == sizeof(struct sockaddr_in6)))
-				wg_peer_set_endpoint(net, peer, resolved->ai_addr, resolved->ai_addrlen);
+	conn = wg_user_conn_get(net);
+	if (!conn)
+		return -1;
 
-			freeaddrinfo(resolved);
-			continue;
-		}
-	}
+	/* the reply is parsed from uloop, skip while a previous one is pending */
+	if (conn->get_pending)
+		return 0;
 
-	if (peer)
-		wg_peer_update_done(net, peer);
+	conn->get_pending = true;
+	conn->now = time(NULL);
+	wg_peer_refresh_start(net);
+	wg_user_txn_add(conn, NULL, 0);
 
-	return wg_req_done(&req);
+	return wg_user_conn_write(conn, req, sizeof(req) - 1);
 }
 
 static int
 wg_user_peer_connect(struct network *net, struct network_peer *peer,
 		      union network_endpoint *ep)
 {
-	struct wg_req req;
+	struct wg_req _req = {}, *req;
 	char addr[INET6_ADDRSTRLEN];
-	char key[WG_KEY_LEN_HEX];
 	const void *ip;
 	int port;
 
-	if (wg_req_init(&req, net, true))
+	req = wg_user_peer_req_init(net, &_req, peer);
+	if (!req)
 		return -1;
 
-	key_to_hex(key, peer->key);
-	wg_req_set(&req, "public_key", key);
-
 	if (ep->in.sin_family == AF_INET6)
 		ip = &ep->in6.sin6_addr;
 	else
@@ -472,17 +786,48 @@ wg_user_peer_connect(struct network *net, struct network_peer *peer,
 	port = ntohs(ep->in.sin_port);
 
 	if (ep->in.sin_family == AF_INET6)
-		wg_req_printf(&req, "endpoint", "[%s]:%d", addr, port);
+		wg_req_printf(req, "endpoint", "[%s]:%d", addr, port);
 	else
-		wg_req_printf(&req, "endpoint", "%s:%d", addr, port);
+		wg_req_printf(req, "endpoint", "%s:%d", addr, port);
 
 	if (net->net_config.keepalive) {
-		wg_req_set_int(&req, "persistent_keepalive_interval", 0);
-		wg_req_set_int(&req, "persistent_keepalive_interval",
+		wg_req_set_int(req, "persistent_keepalive_interval", 0);
+		wg_req_set_int(req, "persistent_keepalive_interval",
 			       net->net_config.keepalive);
 	}
 
-	return wg_req_done(&req);
+	return wg_user_peer_req_done(net, req);
+}
+
+static void
+wg_user_batch_start(struct network *net)
+{
+	struct wg_user_conn *conn = wg_user_conn_get(net);
+
+	if (conn)
+		conn->batch_active = true;
+}
+
+static int
+wg_user_batch_done(struct network *net)
+{
+	struct wg_user_conn *conn = net->wg.user;
+	struct wg_req req;
+
+	if (conn) {
+		conn->batch_active = false;
+		if (conn->batch.f)
+			return wg_user_batch_flush(net);
+	}
+
+	if (!net->wg.replace_peers)
+		return 0;
+
+	/* no peers were added, clear the stale ones anyway */
+	if (wg_req_init(&req, net))
+		return -1;
+
+	return wg_req_done(&req, net);
 }
 
 const struct wg_ops wg_user_ops = {
@@ -494,4 +839,6 @@ const struct wg_ops wg_user_ops = {
 	.peer_update = wg_user_peer_update,
 	.peer_refresh = wg_user_peer_refresh,
 	.peer_connect = wg_user_peer_connect,
+	.batch_start = wg_user_batch_start,
+	.batch_done = wg_user_batch_done,
 };
@@ -32,6 +32,48 @@ void wg_cleanup_network(struct network *net)
 		net->wg.ops->cleanup(net);
 }
 
+void wg_batch_start(struct network *net)
+{
+	if (net->wg.ops && net->wg.ops->batch_start)
+		net->wg.ops->batch_start(net);
+}
+
+int wg_batch_done(struct network *net)
+{
+	if (!net->wg.ops || !net->wg.ops->batch_done)
+		return 0;
+
+	return net->wg.ops->batch_done(net);
+}
+
+static uint64_t wg_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void wg_peer_refresh_start(struct network *net)
+{
+	net->wg.refresh_start = wg_time_us();
+}
+
+void wg_peer_refresh_done(struct network *net)
+{
+	uint64_t duration;
+
+	if (!net->wg.refresh_start)
+		return;
+
+	duration = wg_time_us() - net->wg.refresh_start;
+	net->wg.refresh_start = 0;
+	net->wg.refresh_time = duration;
+	if (net->wg.refresh_time > net->wg.refresh_time_max)
+		net->wg.refresh_time_max = net->wg.refresh_time;
+}
+
 static void
 wg_peer_set_connected(struct network *net, struct network_peer *peer, bool val)
 {
@@ -39,21 +81,33 @@ wg_peer_set_connected(struct network *net, struct network_peer *peer, bool val)
 		return;
 
 	peer->state.connected = val;
+	if (val) {
+		peer->state.connect_backoff = 0;
+		peer->state.connect_next = 0;
+	}
 	network_services_peer_update(net, peer);
 }
 
 struct network_peer *wg_peer_update_start(struct network *net, const uint8_t *key)
 {
 	struct network_peer *peer;
+	uint64_t now;
+	int elapsed;
 
-	peer = vlist_find(&net->peers, key, peer, node);
+	peer = network_peer_find(net, key, WG_KEY_LEN);
 	if (!peer || peer->indirect)
 		return NULL;
 
+	/* peers are not necessarily polled every second */
+	now = unet_gettime();
+	elapsed = peer->state.last_refresh ? now - peer->state.last_refresh : 1;
+	peer->state.last_refresh = now;
+
 	peer->state.handshake = false;
-	peer->state.idle++;
-	if (peer->state.ping_wait > 0)
-		peer->state.ping_wait--;
+	peer->state.idle += elapsed;
+	peer->state.ping_wait -= elapsed;
+	if (peer->state.ping_wait < 0)
+		peer->state.ping_wait = 0;
 	if (peer->state.idle >= 2 * net->net_config.keepalive)
 		wg_peer_set_connected(net, peer, false);
 	if (peer->state.idle > net->net_config.keepalive)
@@ -116,3 +170,172 @@ void wg_peer_set_endpoint(struct network *net, struct network_peer *peer,
 	memcpy(&peer->state.endpoint, data, len);
 	network_pex_event(net, peer, PEX_EV_ENDPOINT_CHANGE);
 }
+
+static void
+wg_prefix_add(struct network_prefix *list, int *n, int af, const void *addr,
+	      int mask)
+{
+	struct network_prefix *p = &list[(*n)++];
+	uint8_t *data = (uint8_t *)&p->addr;
+	int len = af == AF_INET6 ? 16 : 4;
+	int i;
+
+	memcpy(data, addr, len);
+	for (i = mask / 8; i < len; i++) {
+		int bits = mask - i * 8;
+
+		data[i] &= bits > 0 ? 0xff << (8 - bits) : 0;
+	}
+
+	p->af = af;
+	p->mask = mask;
+}
+
+static void
+wg_peer_add_prefixes(struct network_prefix *list, int *n, struct network_peer *peer)
+{
+	int i;
+
+	wg_prefix_add(list, n, AF_INET6, &peer->local_addr, 128);
+	for (i = 0; i < peer->n_addrs; i++)
+		wg_prefix_add(list, n, peer->addrs[i].af, &peer->addrs[i].addr,
+			      peer->addrs[i].mask);
+	for (i = 0; i < peer->n_subnets; i++)
+		wg_prefix_add(list, n, peer->subnets[i].af, &peer->subnets[i].addr,
+			      peer->subnets[i].mask);
+}
+
+static int
+wg_prefix_cmp(const void *k1, const void *k2)
+{
+	const struct network_prefix *p1 = k1, *p2 = k2;
+
+	if (p1->af != p2->af)
+		return p1->af - p2->af;
+
+	if (p1->mask != p2->mask)
+		return p1->mask - p2->mask;
+
+	return memcmp(&p1->addr, &p2->addr, sizeof(p1->addr));
+}
+
+/* sorted AllowedIPs of a peer, including the hosts routed through it */
+int wg_peer_allowed_ips(struct network *net, struct network_peer *peer,
+			struct network_prefix **list)
+{
+	struct network_prefix *ips;
+	struct network_host *host;
+	int i, j, n = 1 + peer->n_addrs + peer->n_subnets;
+
+	for_each_routed_host(host, net, peer)
+		n += 1 + host->peer.n_addrs + host->peer.n_subnets;
+
+	ips = calloc(n, sizeof(*ips));
+	n = 0;
+	wg_peer_add_prefixes(ips, &n, peer);
+	for_each_routed_host(host, net, peer)
+		wg_peer_add_prefixes(ips, &n, &host->peer);
+
+	qsort(ips, n, sizeof(*ips), wg_prefix_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j > 0 && !wg_prefix_cmp(&ips[j - 1], &ips[i]))
+			continue;
+
+		ips[j++] = ips[i];
+	}
+
+	*list = ips;
+
+	return j;
+}
+
+/*
+ * Compare against the list last sent to the backend. Returns the number of
+ * changed entries and calls cb (if set) for each of them.
+ */
+int wg_peer_allowed_ips_diff(struct network_peer *peer, struct network_prefix *list,
+			     int n, int *removed, wg_allowed_ip_cb cb, void *ctx)
+{
+	struct network_prefix *old = peer->state.wg_ips;
+	int n_old = peer->state.n_wg_ips;
+	int i = 0, j = 0, changed = 0;
+
+	if (peer->state.wg_ips_pending) {
+		old = peer->state.wg_ips_pending;
+		n_old = peer->state.n_wg_ips_pending;
+	}
+
+	*removed = 0;
+	while (i < n_old || j < n) {
+		int cmp;
+
+		if (i == n_old)
+			cmp = 1;
+		else if (j == n)
+			cmp = -1;
+		else
+			cmp = wg_prefix_cmp(&old[i], &list[j]);
+
+		if (!cmp) {
+			i++;
+			j++;
+			continue;
+		}
+
+		changed++;
+		if (cmp < 0) {
+			(*removed)++;
+			if (cb)
+				cb(ctx, &old[i], false);
+			i++;
+		} else {
+			if (cb)
+				cb(ctx, &list[j], true);
+			j++;
+		}
+	}
+
+	return changed;
+}
+
+void wg_peer_set_allowed_ips(struct network_peer *peer, struct network_prefix *list,
+			     int n)
+{
+	free(peer->state.wg_ips_pending);
+	peer->state.wg_ips_pending = NULL;
+	peer->state.n_wg_ips_pending = 0;
+
+	free(peer->state.wg_ips);
+	peer->state.wg_ips = list;
+	peer->state.n_wg_ips = n;
+}
+
+/* list is only used for diffs until confirmed by wg_peer_allowed_ips_done */
+void wg_peer_set_allowed_ips_pending(struct network_peer *peer,
+				     struct network_prefix *list, int n)
+{
+	free(peer->state.wg_ips_pending);
+	peer->state.wg_ips_pending = list;
+	peer->state.n_wg_ips_pending = n;
+}
+
+void wg_peer_allowed_ips_done(struct network_peer *peer, bool success)
+{
+	struct network_prefix *list = peer->state.wg_ips_pending;
+	int n = peer->state.n_wg_ips_pending;
+
+	peer->state.wg_ips_pending = NULL;
+	peer->state.n_wg_ips_pending = 0;
+
+	if (success) {
+		if (!list)
+			return;
+
+		wg_peer_set_allowed_ips(peer, list, n);
+		return;
+	}
+
+	free(list);
+	wg_peer_set_allowed_ips(peer, NULL, 0);
+	peer->state.wg_ips_replace = true;
+}
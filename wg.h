@@ -17,6 +17,8 @@ enum wg_update_cmd {
 struct network;
 struct network_peer;
 union network_endpoint;
+struct network_prefix;
+struct wg_user_conn;
 
 struct wg_ops {
 	const char *name;
@@ -31,10 +33,28 @@ struct wg_ops {
 			   enum wg_update_cmd cmd);
 	int (*peer_connect)(struct network *net, struct network_peer *peer,
 			    union network_endpoint *ep);
+
+	/* optional: collect peer_update/peer_connect calls into fewer requests */
+	void (*batch_start)(struct network *net);
+	int (*batch_done)(struct network *net);
 };
 
 struct wg {
 	const struct wg_ops *ops;
+
+	bool replace_peers;
+	bool refresh_pending;
+
+	/* duration of peer refresh runs, in microseconds */
+	uint64_t refresh_start;
+	unsigned int refresh_time;
+	unsigned int refresh_time_max;
+
+	/* wg-linux: WGALLOWEDIP_F_REMOVE_ME support, probed on first use */
+	bool remove_checked;
+	bool remove_supported;
+
+	struct wg_user_conn *user;
 };
 
 extern const struct wg_ops wg_user_ops;
@@ -42,6 +62,8 @@ extern const struct wg_ops wg_linux_ops;
 
 int wg_init_network(struct network *net);
 void wg_cleanup_network(struct network *net);
+void wg_batch_start(struct network *net);
+int wg_batch_done(struct network *net);
 
 #define wg_init_local(net, ...)		(net)->wg.ops->init_local(net, ##__VA_ARGS__)
 #define wg_peer_update(net, ...)	(net)->wg.ops->peer_update(net, ##__VA_ARGS__)
@@ -49,6 +71,8 @@ void wg_cleanup_network(struct network *net);
 #define wg_peer_refresh(net)		(net)->wg.ops->peer_refresh(net)
 
 /* internal */
+void wg_peer_refresh_start(struct network *net);
+void wg_peer_refresh_done(struct network *net);
 struct network_peer *wg_peer_update_start(struct network *net, const uint8_t *key);
 void wg_peer_update_done(struct network *net, struct network_peer *peer);
 void wg_peer_set_last_handshake(struct network *net, struct network_peer *peer,
@@ -60,4 +84,15 @@ void wg_peer_set_tx_bytes(struct network *net, struct network_peer *peer,
 void wg_peer_set_endpoint(struct network *net, struct network_peer *peer,
 			  void *data, size_t len);
 
+typedef void (*wg_allowed_ip_cb)(void *ctx, struct network_prefix *p, bool add);
+int wg_peer_allowed_ips(struct network *net, struct network_peer *peer,
+			struct network_prefix **list);
+int wg_peer_allowed_ips_diff(struct network_peer *peer, struct network_prefix *list,
+			     int n, int *removed, wg_allowed_ip_cb cb, void *ctx);
+void wg_peer_set_allowed_ips(struct network_peer *peer, struct network_prefix *list,
+			     int n);
+void wg_peer_set_allowed_ips_pending(struct network_peer *peer,
+				     struct network_prefix *list, int n);
+void wg_peer_allowed_ips_done(struct network_peer *peer, bool success);
+
 #endif